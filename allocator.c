@@ -1,229 +1,1127 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "allocator.h"
 #include "block.h"
 #include "config.h"
 #include "allocator_impl.h"
 #include "kernel.h"
+#include "lock.h"
+#include "prof.h"
+#include "slab.h"
+#include "tcache.h"
+#include "trace.h"
 
-#define ARENA_SIZE (ALLOCATOR_ARENA_PAGES * ALLOCATOR_PAGE_SIZE)
-#define BLOCK_SIZE_MAX (ARENA_SIZE - BLOCK_STRUCT_SIZE)
+#define SMALL_BINS (ALLOCATOR_SMALL_SIZE_MAX / ALIGN + 1)
+// Attempts to take the lock of a heap before mem_dump() skips the heap
+#define DUMP_LOCK_TRIES 100000
 
-static tree_type blocks_tree = TREE_INITIALIZER;
+/* Segregated free list of small blocks of exactly one size.
+ * Blocks in a bin keep their 'busy' flag and stay out of blocks_tree,
+ * so they are taken and put back in O(1) without merging or rebalancing. */
+struct small_bin {
+    Block *head;	// Blocks are linked through the first word of their payload
+    size_t count;
+};
 
+/* Structure that represents a heap: a set of arenas together with the tree of their free blocks.
+ * Every thread is bound to one heap, so threads bound to different heaps never touch the same blocks.
+ * Every block in an arena records the index of its heap, so it is always returned to the heap it came from. */
+struct heap {
+    tree_type blocks_tree;	// Free blocks of the arenas of the heap
+    lock_type lock;		// Protects blocks_tree and headers of blocks in the arenas of the heap
+    struct small_bin small_bins[SMALL_BINS];	// Free small blocks by size class (size / ALIGN)
+    Block *dirty_head;		// Free blocks with pages not given back to the kernel, oldest first
+    Block *dirty_tail;
+    size_t dirty;		// Bytes of whole pages in the dirty blocks
+    atomic_size_t arena_size;	// Size of the next arena of the heap, 0 until the first one is mapped
+    void *arena_list;		// Arenas of the heap, newest first, see arena_link()
+    size_t arena_bytes;		// Bytes of the arenas of the heap, for mem_stats()
+    size_t arenas;		// Number of arenas of the heap
+    size_t free_bytes;		// Bytes of the blocks in blocks_tree with their headers
+    size_t bin_bytes;		// Bytes of the blocks in small_bins with their headers
+    size_t free_classes[MEM_STATS_CLASSES];	// Number of blocks in blocks_tree by size class
+};
+
+/* A free block is dirty if it is not clean and has whole pages, so it is larger than a page
+ * and there is always room for the links of the dirty list after its tree node.
+ * Dirty blocks carry the 'dirty' flag while they are on the list. */
+struct dirty_link {
+    Block *next;
+    Block *prev;
+    uint64_t time;	// When the block became dirty, in milliseconds
+};
+
+_Static_assert(ALLOCATOR_HEAPS <= (size_t)1 << (sizeof(size_t) * CHAR_BIT - BLOCK_HEAP_SHIFT),
+               "Heap index does not fit into the block header");
+_Static_assert(ALLOCATOR_ARENA_SIZE_MAX <= BLOCK_SIZE_MAX, "Arenas do not fit into the block header");
+
+static struct heap heaps[ALLOCATOR_HEAPS];
+static once_type heaps_once = ONCE_INITIALIZER;
+static atomic_uint heap_next;			// Index of the heap the next new thread is bound to
+static _Thread_local struct heap *thread_heap;	// Heap the calling thread is bound to
+static atomic_bool poison = ALLOCATOR_POISON;	// Fill freed memory with ALLOCATOR_POISON_BYTE
+static atomic_int release = MEM_RELEASE_DONTNEED;	// How memory is given back, enum mem_release
+static atomic_size_t arena_size_min;		// Size of the first arena of a heap, set by heaps_init()
+static atomic_size_t arena_size_max;		// Arenas of a heap stop growing here, set by heaps_init()
+static atomic_bool huge_pages = ALLOCATOR_HUGE_PAGES;	// New arenas are backed with huge pages
+static atomic_size_t large_bytes;		// Bytes mapped for blocks allocated directly from the kernel
+static atomic_size_t large_count;		// Number of blocks allocated directly from the kernel
+static atomic_size_t slab_samples;		// Number of objects of slabs the heap profiler keeps a sample of
+
+// Values of the MEM_RELEASE environment variable in the order of enum mem_release
+static const char *const release_names[] = { "dontneed", "free", "munmap", "none" };
+
+static void heaps_init(void) {
+    const char *env;
+
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        tree_init(&heaps[i].blocks_tree);
+        lock_init(&heaps[i].lock);
+    }
+
+    // Arena sizes are whole pages of the kernel the program runs on
+    atomic_store_explicit(&arena_size_min, ALLOCATOR_ARENA_PAGES * kernel_page_size(), memory_order_relaxed);
+    atomic_store_explicit(&arena_size_max, ROUND((size_t)ALLOCATOR_ARENA_SIZE_MAX, kernel_page_size()),
+                          memory_order_relaxed);
+
+    // The release strategy may be chosen without rebuilding the program
+    env = getenv("MEM_RELEASE");
+    if (env != NULL) {
+        for (unsigned int i = 0; i < sizeof(release_names) / sizeof(release_names[0]); ++i) {
+            if (strcmp(env, release_names[i]) == 0) {
+                atomic_store_explicit(&release, (int)i, memory_order_relaxed);
+            }
+        }
+    }
+    env = getenv("MEM_HUGE_PAGES");
+    if (env != NULL) {
+        atomic_store_explicit(&huge_pages, strcmp(env, "0") != 0, memory_order_relaxed);
+    }
+}
+
+// Function that returns the current release strategy
+static inline enum mem_release release_get(void) {
+    return (enum mem_release)atomic_load_explicit(&release, memory_order_relaxed);
+}
+
+// Function that checks if pages of free blocks are given back to the kernel with the strategy
+static inline bool release_pages(enum mem_release strategy) {
+    return strategy == MEM_RELEASE_DONTNEED || strategy == MEM_RELEASE_FREE;
+}
+
+// Function that returns the heap the calling thread is bound to, binding threads to heaps round-robin
+static struct heap *heap_get(void) {
+    if (thread_heap == NULL) {
+        once_call(&heaps_once, heaps_init);
+        thread_heap = &heaps[atomic_fetch_add(&heap_next, 1) % ALLOCATOR_HEAPS];
+    }
+    return thread_heap;
+}
+
+// Function that returns the heap owning the block
+static inline struct heap *block_heap(const Block *block) {
+    return &heaps[block_get_heap(block)];
+}
+
+// Function that returns the index of the heap in heaps[]
+static inline unsigned int heap_index(const struct heap *heap) {
+    return (unsigned int)(heap - heaps);
+}
+
+// Function that rounds the size of an arena up to whole pages, or whole huge pages if it is backed with them
+static inline size_t arena_round(size_t size, bool huge) {
+    return ROUND(size, huge ? (size_t)ALLOCATOR_HUGE_PAGE_SIZE : kernel_page_size());
+}
+
+// Function that returns the size of the next arena of the heap within the current limits
+static size_t heap_arena_size(struct heap *heap, bool huge) {
+    size_t size, size_min, size_max;
+
+    size = atomic_load_explicit(&heap->arena_size, memory_order_relaxed);
+    size_min = atomic_load_explicit(&arena_size_min, memory_order_relaxed);
+    size_max = atomic_load_explicit(&arena_size_max, memory_order_relaxed);
+    if (size < size_min) {
+        size = size_min;
+    }
+    return arena_round(size < size_max ? size : size_max, huge);
+}
+
+// Function that returns the max block size of the heap, larger blocks are allocated directly from the kernel
+static inline size_t heap_block_max(struct heap *heap) {
+    return heap_arena_size(heap, atomic_load_explicit(&huge_pages, memory_order_relaxed)) - ARENA_OVERHEAD;
+}
+
+/* Function heap_arena_next() returns the size of a new arena of the heap for a block of the given size
+ * and doubles the size of the arena after it, up to the max arena size.
+ * The caller must hold the lock of the heap. */
+static size_t heap_arena_next(struct heap *heap, size_t size, bool huge) {
+    size_t arena_size, size_max;
+
+    arena_size = heap_arena_size(heap, huge);
+    size_max = atomic_load_explicit(&arena_size_max, memory_order_relaxed);
+    atomic_store_explicit(&heap->arena_size, arena_size <= size_max / 2 ? arena_size * 2 : size_max,
+                          memory_order_relaxed);
+
+    // The limits may have been lowered since the size of the block was checked against them
+    if (size > arena_size - ARENA_OVERHEAD) {
+        arena_size = arena_round(size + ARENA_OVERHEAD, huge);
+    }
+    return arena_size;
+}
+
+/* Function heap_arena_shrink() sets the size of the next arena of the heap back to what it would be
+ * had the heap only ever mapped the arenas it has now: the min size doubled once per arena, up to the max size.
+ * So a heap whose arenas have been freed maps small arenas again. The caller must hold the lock of the heap. */
+static void heap_arena_shrink(struct heap *heap) {
+    size_t size, size_max;
+
+    size = atomic_load_explicit(&arena_size_min, memory_order_relaxed);
+    size_max = atomic_load_explicit(&arena_size_max, memory_order_relaxed);
+    for (size_t i = 0; i < heap->arenas && size < size_max; ++i) {
+        size *= 2;
+    }
+    atomic_store_explicit(&heap->arena_size, size < size_max ? size : size_max, memory_order_relaxed);
+}
+
+// Function that returns the current time in milliseconds
+static uint64_t time_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Cache of empty arenas, the oldest one first and the most recently emptied one on top.
+ * Arenas in the cache keep their pages, so they are reused without faulting them in again. */
+struct arena_cache_entry {
+    void *arena;
+    size_t size;
+    bool huge;		// The arena is backed with huge pages
+    uint64_t time;	// When the arena was put into the cache, in milliseconds
+};
+
+static struct arena_cache_entry arena_cache[ALLOCATOR_ARENA_CACHE_COUNT > 0 ? ALLOCATOR_ARENA_CACHE_COUNT : 1];
+static size_t arena_cache_count;
+static size_t arena_cache_bytes;
+static lock_type arena_cache_lock = LOCK_INITIALIZER;
+
+/* Function arena_cache_trim() unmaps cached arenas that have not been reused for ALLOCATOR_ARENA_CACHE_DECAY_MS
+ * milliseconds, or all of them if all is true. The caller must hold arena_cache_lock.
+ * It returns the number of bytes given back. */
+static size_t arena_cache_trim(bool all) {
+    uint64_t now = time_ms();
+    size_t i, n = 0, released = 0;
+
+    for (i = 0; i < arena_cache_count; ++i) {
+        if (all || now - arena_cache[i].time >= ALLOCATOR_ARENA_CACHE_DECAY_MS) {
+            kernel_free(arena_cache[i].arena, arena_cache[i].size);
+            arena_cache_bytes -= arena_cache[i].size;
+            released += arena_cache[i].size;
+        } else {
+            arena_cache[n++] = arena_cache[i];
+        }
+    }
+    arena_cache_count = n;
+    return released;
+}
+
+/* Function that takes an arena of at least the given size and backed with the same kind of pages from the cache,
+ * it returns NULL if there is none */
+static void *arena_cache_get(size_t size, bool huge, size_t *size_arena) {
+    void *arena = NULL;
+    size_t i;
+
+    lock_acquire(&arena_cache_lock);
+    arena_cache_trim(false);
+    for (i = arena_cache_count; i-- > 0;) {
+        if (arena_cache[i].size >= size && arena_cache[i].huge == huge) {
+            arena = arena_cache[i].arena;
+            *size_arena = arena_cache[i].size;
+            arena_cache_bytes -= arena_cache[i].size;
+            memmove(arena_cache + i, arena_cache + i + 1, (--arena_cache_count - i) * sizeof(arena_cache[0]));
+            break;
+        }
+    }
+    lock_release(&arena_cache_lock);
+    return arena;
+}
+
+/* Function arena_free() puts an empty arena into the cache or unmaps it if the cache is full.
+ * The oldest cached arena gives way to the new one if there is no room by count. */
+static void arena_free(void *arena, size_t size, bool huge) {
+    lock_acquire(&arena_cache_lock);
+    arena_cache_trim(false);
+    if (size > ALLOCATOR_ARENA_CACHE_BYTES || ALLOCATOR_ARENA_CACHE_COUNT == 0) {
+        lock_release(&arena_cache_lock);
+        kernel_free(arena, size);
+        return;
+    }
+    while (arena_cache_count == ALLOCATOR_ARENA_CACHE_COUNT || arena_cache_bytes + size > ALLOCATOR_ARENA_CACHE_BYTES) {
+        kernel_free(arena_cache[0].arena, arena_cache[0].size);
+        arena_cache_bytes -= arena_cache[0].size;
+        memmove(arena_cache, arena_cache + 1, --arena_cache_count * sizeof(arena_cache[0]));
+    }
+    arena_cache[arena_cache_count].arena = arena;
+    arena_cache[arena_cache_count].size = size;
+    arena_cache[arena_cache_count].huge = huge;
+    arena_cache[arena_cache_count].time = time_ms();
+    ++arena_cache_count;
+    arena_cache_bytes += size;
+    lock_release(&arena_cache_lock);
+}
 
 /* Function arena_alloc() allocates memory from the kernel for the arena.
- * If the requested size > max block size, it directly allocates the requested size.
- * Otherwise, it allocates the entire arena size.
- * It takes size of the memory to allocate as paremeter and returns pointer to the allocated memory block.
+ * It takes an arena of at least the requested size from the cache of empty arenas
+ * or allocates a new one of exactly that size.
+ * It takes the heap the arena belongs to, size of the arena and whether it is backed with huge pages
+ * as paremeters and returns pointer to the first block of the arena.
  */
-static Block* arena_alloc(size_t size) {
+static Block* arena_alloc(struct heap *heap, size_t size, bool huge) {
+    void *arena;
     Block *block;
 
-    if (size > BLOCK_SIZE_MAX) {
-        block = kernel_alloc(size);
-        if (block != NULL) {
-            arena_init(block, size - BLOCK_STRUCT_SIZE);
-        }
+    // An arena emptied recently is reused before a new one is mapped, its pages are not clean
+    arena = arena_cache_get(size, huge, &size);
+    if (arena != NULL) {
+        block = arena_init(arena, size, heap_index(heap));
+        block_clr_flag_clean(block);
     } else {
-        block = kernel_alloc(ARENA_SIZE);
-        if (block != NULL) {
-            arena_init(block, ARENA_SIZE - BLOCK_STRUCT_SIZE);
+        arena = huge ? kernel_alloc_huge(size, ALLOCATOR_HUGE_PAGE_SIZE) : kernel_alloc(size);
+        if (arena == NULL) {
+            return NULL;
         }
+        block = arena_init(arena, size, heap_index(heap));
+    }
+    if (huge) {
+        block_set_flag_huge(block);
     }
     return block;
 }
 
-// Function that adds a block to the binary search tree
+/* Function that returns the link to the next arena of the heap. It is the word in front of the first block,
+ * which only blocks allocated directly from the kernel use for something else, see arena_get_gap(). */
+static inline void **arena_link(void *arena) {
+    return (void **)((char *)arena_to_block(arena) - sizeof(void *));
+}
+
+/* Function heap_arena_remove() takes the arena off the list of arenas of the heap.
+ * The list is searched, but arenas grow with every one mapped, so a heap has few of them,
+ * and an arena is emptied rarely. The caller must hold the lock of the heap. */
+static void heap_arena_remove(struct heap *heap, void *arena) {
+    void **link;
+
+    for (link = &heap->arena_list; *link != arena; link = arena_link(*link)) {
+        assert(*link != NULL);
+    }
+    *link = *arena_link(arena);
+}
+
+// Function that returns the links of a dirty block
+static inline struct dirty_link *block_dirty_link(Block *block) {
+    return (struct dirty_link *)((char *)block_to_payload(block) + sizeof(tree_node_type));
+}
+
+// Function that returns the number of bytes in whole pages of a block that could be given back to the kernel
+static size_t block_pages_size(const Block *block) {
+    uintptr_t start, end;
+
+    block_trim_range(block, &start, &end);
+    return start < end ? end - start : 0;
+}
+
+// Function that appends a dirty block to the dirty list of its heap
+static void dirty_add(struct heap *heap, Block *block, size_t size) {
+    struct dirty_link *link = block_dirty_link(block);
+
+    link->next = NULL;
+    link->prev = heap->dirty_tail;
+    link->time = time_ms();
+    block_set_flag_dirty(block);
+    if (heap->dirty_tail != NULL) {
+        block_dirty_link(heap->dirty_tail)->next = block;
+    } else {
+        heap->dirty_head = block;
+    }
+    heap->dirty_tail = block;
+    heap->dirty += size;
+}
+
+// Function that removes a dirty block from the dirty list of its heap
+static void dirty_remove(struct heap *heap, Block *block, size_t size) {
+    struct dirty_link *link = block_dirty_link(block);
+
+    if (link->prev != NULL) {
+        block_dirty_link(link->prev)->next = link->next;
+    } else {
+        heap->dirty_head = link->next;
+    }
+    if (link->next != NULL) {
+        block_dirty_link(link->next)->prev = link->prev;
+    } else {
+        heap->dirty_tail = link->prev;
+    }
+    block_clr_flag_dirty(block);
+    heap->dirty -= size;
+}
+
+// Function that returns the size class of mem_stats() of a block with its header, floor(log2(size)) - 4
+static inline unsigned int stats_class(size_t size) {
+    unsigned int class = (unsigned int)(sizeof(unsigned long long) * CHAR_BIT - 1) - (unsigned int)__builtin_clzll(size);
+
+    class = class < 4 ? 0 : class - 4;
+    return class < MEM_STATS_CLASSES ? class : MEM_STATS_CLASSES - 1;
+}
+
+// Function that adds a block to the binary search tree of its heap, a dirty block goes to the dirty list as well
 static void tree_add_block(Block* block) {
+    struct heap *heap = block_heap(block);
+    size_t size;
+
     assert(block_get_flag_busy(block) == false);
-    tree_add(&blocks_tree, block_to_node(block), block_get_size_curr(block));
+    tree_add(&heap->blocks_tree, block_to_node(block), block_get_size_curr(block));
+    size = block_get_size_curr(block) + BLOCK_STRUCT_SIZE;
+    heap->free_bytes += size;
+    ++heap->free_classes[stats_class(size)];
+    // Under every strategy, so the pages are found if the strategy is changed to one that releases them
+    if (!block_get_flag_clean(block)) {
+        size = block_pages_size(block);
+        if (size != 0) {
+            dirty_add(heap, block, size);
+        }
+    }
 }
 
-// Function that removes a block from the binary search tree
+// Function that removes a block from the binary search tree of its heap and from the dirty list
 static void tree_remove_block(Block* block) {
-    assert(block_get_flag_busy(block) == false);
-    tree_remove(&blocks_tree, block_to_node(block));
+    struct heap *heap = block_heap(block);
+
+    size_t size;
 
+    assert(block_get_flag_busy(block) == false);
+    tree_remove(&heap->blocks_tree, block_to_node(block));
+    size = block_get_size_curr(block) + BLOCK_STRUCT_SIZE;
+    heap->free_bytes -= size;
+    --heap->free_classes[stats_class(size)];
+    if (block_get_flag_dirty(block)) {
+        dirty_remove(heap, block, block_pages_size(block));
+    }
 }
 
-/* Function mem_alloc() allocates memory of the specified size.
- * If the requested size exceeds the maximum block size, it allocates memory directly from the kernel.
- * In other case, it searched for a suitable block in the binary tree.
- * If no suitable block is found, it allocates memory from the arena.
- * It takes size of memory to allocate as a parameter.
- * If the allocation is successful, the function returns pointer to the allocated memory block.
- * If the allocation failed, the function returns NULL. */
-void* mem_alloc(size_t size) {
-    Block *block, *block_r;
-    tree_node_type *node;
+/* Function heap_trim() gives pages of dirty blocks of the heap back to the kernel, oldest first.
+ * It goes on while more than keep bytes are dirty or the oldest block has been dirty
+ * for ALLOCATOR_TRIM_DECAY_MS milliseconds. Blocks stay in the tree, they just become clean.
+ * With a strategy that keeps pages nothing is given back and the blocks stay on the dirty list,
+ * until the strategy is changed to one that releases them.
+ * The caller must hold the lock of the heap. It returns the number of bytes given back. */
+static size_t heap_trim(struct heap *heap, size_t keep) {
+    enum mem_release strategy = release_get();
+    Block *block;
+    size_t size, released = 0;
+    uint64_t now;
 
-    if (size > BLOCK_SIZE_MAX) {
-        if (size > SIZE_MAX - (ALIGN - 1)) {
-            return NULL;	// Overflow, return NULL
+    if (!release_pages(strategy)) {
+        return 0;
+    }
+    now = time_ms();
+    while ((block = heap->dirty_head) != NULL) {
+        if (heap->dirty <= keep && now - block_dirty_link(block)->time < ALLOCATOR_TRIM_DECAY_MS) {
+            break;
         }
-	// Calculate the size needed for the arena and allocate memory from the kernel
-        size_t arena_size = (ROUND_BYTES(size) / ALLOCATOR_PAGE_SIZE) * ALLOCATOR_PAGE_SIZE + BLOCK_STRUCT_SIZE;
-        block = arena_alloc(arena_size);
-        return block_to_payload(block);	// Return payload of the allocated block
+        size = block_pages_size(block);
+        dirty_remove(heap, block, size);
+        block_dontneed(block, strategy == MEM_RELEASE_FREE);
+        released += size;
     }
+    return released;
+}
 
-    // If the size is less than minimum block size, resize the requested size for it to be at least minimum
-    if (size < BLOCK_SIZE_MIN) {
-        size = BLOCK_SIZE_MIN;
+/* Function heap_trim_check() releases dirty pages of the heap if there are too many of them
+ * or the oldest ones have not been reused for ALLOCATOR_TRIM_DECAY_MS milliseconds.
+ * The caller must hold the lock of the heap. */
+static void heap_trim_check(struct heap *heap) {
+    size_t threshold = ALLOCATOR_TRIM_THRESHOLD_PAGES * kernel_page_size();
+
+    // Nothing would be given back, and the clock need not be read on every free
+    if (!release_pages(release_get())) {
+        return;
     }
 
-    // Align the requested size to meet memory alignment requirenments
-    size_t aligned_size = ROUND_BYTES(size);
+    if (heap->dirty > threshold) {
+        heap_trim(heap, threshold / 2);
+    } else if (heap->dirty_head != NULL
+               && time_ms() - block_dirty_link(heap->dirty_head)->time >= ALLOCATOR_TRIM_DECAY_MS) {
+        heap_trim(heap, SIZE_MAX);
+    }
+}
+
+/* Function heap_take() takes a block of at least the given aligned size from the tree of the heap.
+ * If no suitable block is found, it allocates a new arena for the heap.
+ * The block is marked busy and the remainder is split off back to the tree.
+ * The caller must hold the lock of the heap; the lock is dropped while a new arena is mapped.
+ * It returns NULL if the arena allocation fails. */
+static Block *heap_take(struct heap *heap, size_t size) {
+    Block *block, *block_r;
+    tree_node_type *node;
+    size_t arena_size;
+    bool huge;
 
     // Search for the fir block in the binary search tree
-    node = tree_find_best(&blocks_tree, aligned_size);
+    node = tree_find_best(&heap->blocks_tree, size);
 
     // If not suitable block found, allocate memory from arena
     if (node == NULL) {
-        block = arena_alloc(aligned_size);
+	// The new arena is private until its remainder is added to the tree, so do not hold the lock in mmap()
+        huge = atomic_load_explicit(&huge_pages, memory_order_relaxed);
+        arena_size = heap_arena_next(heap, size, huge);
+        lock_release(&heap->lock);
+        block = arena_alloc(heap, arena_size, huge);
+        lock_acquire(&heap->lock);
 
 	// If arena allocation fails, return NULL
         if (block == NULL) {
             return NULL;
         }
+        heap->arena_bytes += block_get_size_curr(block) + ARENA_OVERHEAD;
+        ++heap->arenas;
+        *arena_link(block_to_arena(block)) = heap->arena_list;
+        heap->arena_list = block_to_arena(block);
 
     } else {
 	// If the suitable block to allocate memory to has been found, then remove it from the tree
-        tree_remove(&blocks_tree, node);
-
-	// Convert tree node to a block
         block = node_to_block(node);
+        tree_remove_block(block);
     }
 
     // Perform block splitting if necessary and add remaining block to the tree
-    block_r = block_split(block, aligned_size);
+    block_r = block_split(block, size);
     if (block_r != NULL) {
         tree_add_block(block_r);
     }
+    return block;
+}
+
+// Function that puts a busy small block into the bin of its size, it returns false if the bin is full
+static bool small_bin_push(struct heap *heap, Block *block, size_t count_max) {
+    struct small_bin *bin;
+    size_t size;
+
+    size = block_get_size_curr(block);
+    if (size > ALLOCATOR_SMALL_SIZE_MAX) {
+        return false;
+    }
+    bin = &heap->small_bins[size / ALIGN];
+    if (bin->count >= count_max) {
+        return false;
+    }
+    *block_link(block) = bin->head;
+    block_set_flag_binned(block);
+    bin->head = block;
+    ++bin->count;
+    heap->bin_bytes += size + BLOCK_STRUCT_SIZE;
+    return true;
+}
+
+// Function that takes a block of exactly the given small size from its bin, it returns NULL if the bin is empty
+static Block *small_bin_pop(struct heap *heap, size_t size) {
+    struct small_bin *bin;
+    Block *block;
+
+    bin = &heap->small_bins[size / ALIGN];
+    block = bin->head;
+    if (block != NULL) {
+        bin->head = *block_link(block);
+        block_clr_flag_binned(block);
+        --bin->count;
+        heap->bin_bytes -= size + BLOCK_STRUCT_SIZE;
+    }
+    return block;
+}
+
+/* Function small_slab_carve() refills the empty bin of a small size from one slab.
+ * The slab is a block of about ALLOCATOR_SMALL_SLAB_SIZE bytes taken from the tree of the heap
+ * (or a new arena), cut into consecutive busy blocks of the size, but no more than the bin holds.
+ * So the tree is searched once per slab instead of once per small allocation.
+ * It returns the first block of the slab and puts the others into the bin.
+ * The caller must hold the lock of the heap. */
+static Block *small_slab_carve(struct heap *heap, size_t size) {
+    Block *slab, *block, *block_r;
+    size_t count;
+
+    count = (ALLOCATOR_SMALL_SLAB_SIZE + BLOCK_STRUCT_SIZE) / (size + BLOCK_STRUCT_SIZE);
+    if (count > ALLOCATOR_SMALL_BIN_COUNT + 1) {
+        count = ALLOCATOR_SMALL_BIN_COUNT + 1;
+    }
+    slab = heap_take(heap, count * (size + BLOCK_STRUCT_SIZE) - BLOCK_STRUCT_SIZE);
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    for (block = block_split(slab, size); block != NULL; block = block_r) {
+        block_r = block_split(block, size);
+	// The tail of a slab taken from a slightly bigger block may not match the size
+        if (!small_bin_push(heap, block, ALLOCATOR_SMALL_BIN_COUNT)) {
+            block_clr_flag_busy(block);
+            block_update_tag(block);
+            tree_add_block(block);
+        }
+    }
+    return slab;
+}
+
+/* Function block_mark_sampled() sets or clears the 'sampled' flag of a busy block.
+ * The lock of the heap is taken: a neighbour that is freed at the same time sets 'prev_free' in the same header.
+ * A block allocated directly from the kernel has no neighbours. Sampled blocks are rare, so is the locking. */
+static void block_mark_sampled(Block *block, bool sampled) {
+    struct heap *heap = NULL;
+
+    if (!block_get_flag_mapped(block)) {
+        heap = block_heap(block);
+        lock_acquire(&heap->lock);
+    }
+    if (sampled) {
+        block_set_flag_sampled(block);
+    } else {
+        block_clr_flag_sampled(block);
+    }
+    if (heap != NULL) {
+        lock_release(&heap->lock);
+    }
+}
+
+/* Function block_sample() passes an allocation that is due for a sample to the heap profiler
+ * and marks the block if it has been sampled, so heap_free() tells the profiler to forget it.
+ * An object of a slab has no header to mark, it is only counted: heap_free() looks objects of slabs up
+ * in the table of samples while any of them is sampled.
+ * It is not inlined, the heap profiler skips its frame. */
+__attribute__((noinline))
+static void block_sample(void *ptr, size_t size) {
+    bool slab = ptr != NULL && slab_owns(ptr);
+
+    if (prof_sample(ptr, size)) {
+        if (slab) {
+            atomic_fetch_add_explicit(&slab_samples, 1, memory_order_relaxed);
+        } else {
+            block_mark_sampled(payload_to_block(ptr), true);
+        }
+    }
+}
+
+// Function that makes the heap profiler forget a block that is freed or reallocated
+static void block_unsample(Block *block) {
+    prof_forget(block_to_payload(block));
+    block_mark_sampled(block, false);
+}
+
+// Function that makes the heap profiler forget an object of a slab that is freed or reallocated, if it has a sample
+static void slab_unsample(void *ptr) {
+    if (atomic_load_explicit(&slab_samples, memory_order_relaxed) != 0 && prof_forget(ptr)) {
+        atomic_fetch_sub_explicit(&slab_samples, 1, memory_order_relaxed);
+    }
+}
+
+/* Function heap_alloc() allocates memory of the specified size.
+ * If the requested size exceeds the maximum block size of the heap, it allocates memory directly from the kernel.
+ * In other case, it searched for a suitable block in the binary tree of the heap of the calling thread.
+ * If no suitable block is found, it allocates memory from a new arena of that heap.
+ * Small requests are served from the cache of the calling thread first, without taking any lock,
+ * and then from the small bins of the heap.
+ * It takes size of memory to allocate as a parameter.
+ * If the allocation is successful, the function returns pointer to the allocated memory block.
+ * If the allocation failed, the function returns NULL. */
+static void *heap_alloc(size_t size) {
+    struct heap *heap;
+    Block *block;
+
+    heap = heap_get();
+    if (size > heap_block_max(heap)) {
+        if (size > BLOCK_SIZE_MAX) {
+            return NULL;	// The size would not fit into the header, return NULL
+        }
+	// Calculate the size needed for the arena and allocate memory from the kernel
+        // (rounded up to whole pages, so the block is never smaller than requested)
+        size_t arena_size = ROUND(BLOCK_SIZE_ROUND(size) + ARENA_OVERHEAD, kernel_page_size());
+        // Memory of a huge page or more is backed with huge pages if arenas are
+        void *arena = arena_size >= ALLOCATOR_HUGE_PAGE_SIZE && atomic_load_explicit(&huge_pages, memory_order_relaxed)
+            ? kernel_alloc_huge(arena_size, ALLOCATOR_HUGE_PAGE_SIZE) : kernel_alloc(arena_size);
+        if (arena == NULL) {
+            return NULL;
+        }
+        block = arena_init(arena, arena_size, heap_index(heap));
+        block_set_flag_mapped(block);
+        block_set_flag_busy(block);
+        atomic_fetch_add_explicit(&large_bytes, arena_size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&large_count, 1, memory_order_relaxed);
+        return block_to_payload(block);	// Return payload of the allocated block
+    }
+
+    // If the size is less than minimum block size, resize the requested size for it to be at least minimum
+    if (size < BLOCK_SIZE_MIN) {
+        size = BLOCK_SIZE_MIN;
+    }
+
+    // Align the requested size to meet memory alignment requirenments
+    size_t aligned_size = BLOCK_SIZE_ROUND(size);
+
+    // Try a block of exactly this size freed earlier by the calling thread
+    block = tcache_get(aligned_size);
+    if (block != NULL) {
+        return block_to_payload(block);
+    }
+
+    lock_acquire(&heap->lock);
+
+    // Small sizes are served from their bins, refilled a slab at a time
+    if (aligned_size <= ALLOCATOR_SMALL_SIZE_MAX) {
+        block = small_bin_pop(heap, aligned_size);
+        if (block == NULL) {
+            block = small_slab_carve(heap, aligned_size);
+        }
+    } else {
+        block = heap_take(heap, aligned_size);
+    }
+    lock_release(&heap->lock);
+
+    // If arena allocation fails, return NULL
+    if (block == NULL) {
+        return NULL;
+    }
     return block_to_payload(block);	// Return payload of the allocated block
 }
 
-// Function that shows information about a node in the binary search tree.
-static void show_node(const tree_node_type *node, const bool linked) {
-    Block* block = node_to_block(node);
-    printf("[%20p] %10zu %10zu %s %s %s %s\n", (void*)block,
+// Function that shows information about a block
+static void show_block(const Block *block) {
+    printf("[%20p] %10zu %s %s %s %s %s %s\n", (void*)block,
     block_get_size_curr(block),
-    block_get_size_prev(block),
     block_get_flag_busy(block) ? "busy" : "free",
     block_get_flag_first(block) ? "first" : "",
     block_get_flag_last(block) ? "last" : "",
-    linked ? "linked" : "");
+    block_get_flag_clean(block) ? "clean" : "",
+    block_get_flag_huge(block) ? "huge" : "",
+    block_get_flag_binned(block) ? "binned" : "");
 }
 
-// Function that displays current state of the memory blocks
+// Function that displays every block of every arena, busy and free, in address order
 void mem_show(const char *msg) {
+    struct heap *heap;
+    void *arena;
+    Block *block;
+    bool empty = true;
+
     printf("%s:\n", msg);
-    if (tree_is_empty(&blocks_tree)) {
-        printf("Tree is empty\n");
+    heap_get();
+    for (heap = heaps; heap < heaps + ALLOCATOR_HEAPS; ++heap) {
+        lock_acquire(&heap->lock);
+	// Heaps without arenas are skipped, most of them are not used by any thread
+        if (heap->arena_list != NULL) {
+            if (ALLOCATOR_HEAPS > 1) {
+                printf("Heap %u:\n", heap_index(heap));
+            }
+            for (arena = heap->arena_list; arena != NULL; arena = *arena_link(arena)) {
+                for (block = arena_to_block(arena); ; block = block_next(block)) {
+                    show_block(block);
+                    if (block_get_flag_last(block)) {
+                        break;
+                    }
+                }
+            }
+            empty = false;
+        }
+        lock_release(&heap->lock);
+    }
+    if (empty) {
+        printf("Heap is empty\n");
+    }
+}
+
+/* Function block_release() marks the block as unoccupied and if possible, merges adjacent free blocks.
+ * If the merged block covers the whole arena, the arena goes to the cache of empty arenas.
+ * Otherwise, it add the block back to the tree and does memory trimming if needed.
+ * The caller must hold the lock of the heap of the block. */
+static void block_release(Block *block) {
+    Block *block_r, *block_l;
+
+    // Clear 'busy' flag, the program may have written anything into the block
+    block_clr_flag_busy(block);
+    block_clr_flag_clean(block);
+
+    if (!block_get_flag_last(block)) {
+        block_r = block_next(block);
+	// If the block is not the last block in the arena, attempt to merge with the next block
+        if (!block_get_flag_busy(block_r)) {
+            tree_remove_block(block_r);
+            block_merge(block, block_r);
+        }
+    }
+    // If the previous block is free, its size is in its footer, merge with it
+    if (block_get_flag_prev_free(block)) {
+        block_l = block_prev(block);
+        tree_remove_block(block_l);
+        block_merge(block_l, block);
+
+	// Update block pointer to the merged block
+        block = block_l;
+    }
+
+    // If the block is both the first and last block in the arena, free the entire arena unless arenas are kept
+    if (block_get_flag_first(block) && block_get_flag_last(block) && release_get() != MEM_RELEASE_NONE) {
+        block_heap(block)->arena_bytes -= block_get_size_curr(block) + ARENA_OVERHEAD;
+        --block_heap(block)->arenas;
+        heap_arena_shrink(block_heap(block));
+        heap_arena_remove(block_heap(block), block_to_arena(block));
+        arena_free(block_to_arena(block), block_get_size_curr(block) + ARENA_OVERHEAD, block_get_flag_huge(block));
     } else {
-        tree_walk(&blocks_tree, show_node);
+	// Otherwise, write the boundary tag and add the block back to the tree, its pages are released lazily
+        block_update_tag(block);
+        tree_add_block(block);
+        heap_trim_check(block_heap(block));
+    }
+}
+
+/* Function blocks_release() releases a chain of busy blocks linked through the first word of their payloads.
+ * It is used by thread caches to hand blocks back in batches.
+ * Blocks of the chain may belong to different heaps (remote frees), so the chain is released in passes:
+ * each pass takes the lock of one heap once and releases all blocks of that heap,
+ * leaving blocks of other heaps for the next pass. */
+void blocks_release(Block *block) {
+    struct heap *heap;
+    Block *block_n, *rest, **rest_tail;
+
+    while (block != NULL) {
+        heap = block_heap(block);
+        rest = NULL;
+        rest_tail = &rest;
+        lock_acquire(&heap->lock);
+        for (; block != NULL; block = block_n) {
+	    // Read the link before the payload is reused as a tree node
+            block_n = *block_link(block);
+            if (block_heap(block) == heap) {
+                if (!small_bin_push(heap, block, ALLOCATOR_SMALL_BIN_COUNT)) {
+                    block_release(block);
+                }
+            } else {
+                *rest_tail = block;
+                rest_tail = block_link(block);
+            }
+        }
+        *rest_tail = NULL;
+        lock_release(&heap->lock);
+        block = rest;
+    }
+}
+
+/* Function heap_bins_release() empties the small bins of the heap into its tree,
+ * so their blocks merge with their neighbours and arenas they kept from being freed are freed.
+ * The caller must hold the lock of the heap. */
+static void heap_bins_release(struct heap *heap) {
+    struct small_bin *bin;
+
+    for (bin = heap->small_bins; bin < heap->small_bins + SMALL_BINS; ++bin) {
+        while (bin->head != NULL) {
+            block_release(small_bin_pop(heap, block_get_size_curr(bin->head)));
+        }
     }
 }
 
-/* Function mem_free() frees the memory block pointed to by ptr.
+/* Function heap_free() frees the memory block pointed to by ptr.
  * If the ptr is NULL, the function returns without doing anything/
- * Otherwise, it marks the block as unoccupied and if possible, merges adjacent free blocks.
+ * If ptr is an object of a slab, it is returned to the slab.
  * If the size of the block > max block size, it directly releases the memory in kernel.
- * Otherwise, it add the block back to the tree and does memory trimming if needed.*/
-void mem_free(void *ptr) {
-    Block *block, *block_r, *block_l;
+ * Small blocks are kept in the cache of the calling thread or in the small bins of their heap.
+ * Otherwise, the block is released to the tree of its heap under the lock of that heap.*/
+static void heap_free(void *ptr) {
+    struct heap *heap;
+    Block *block;
 
     // If ptr is NULL, return without doing anything
     if (ptr == NULL) {
         return;
     }
 
+    // Objects allocated from slabs have no block header, their pages are found in the page map
+    if (slab_owns(ptr)) {
+        if (atomic_load_explicit(&poison, memory_order_relaxed)) {
+            memset(ptr, ALLOCATOR_POISON_BYTE, slab_object_size(ptr));
+        }
+        slab_unsample(ptr);
+        slab_free(ptr);
+        return;
+    }
+
     // Convert payload pointer to block pointer
     block = payload_to_block(ptr);
+    assert(((uintptr_t)ptr & (ALIGN - 1)) == 0);	// Make sure that the pointer came from mem_alloc()
+    assert(block_get_flag_busy(block) == true);	// Make sure that the block is not freed twice
 
-    // Clear 'busy' flag
-    block_clr_flag_busy(block);
+    if (block_get_flag_sampled(block)) {
+        block_unsample(block);
+    }
+
+    // Poison the payload of a block that stays mapped, an unmapped one faults on any use anyway
+    if (atomic_load_explicit(&poison, memory_order_relaxed) && !block_get_flag_mapped(block)) {
+        memset(ptr, ALLOCATOR_POISON_BYTE, block_get_size_curr(block));
+    }
+
+    // If the block has been allocated directly from the kernel, it directly releases the memory in kernel.
+    if (block_get_flag_mapped(block)) {
+        size_t arena_size = block_get_size_curr(block) + ARENA_OVERHEAD + arena_get_gap(block);
+
+        atomic_fetch_sub_explicit(&large_bytes, arena_size, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&large_count, 1, memory_order_relaxed);
+        kernel_free((char *)block_to_arena(block) - arena_get_gap(block), arena_size);
+        return;
+    }
 
-    // If the size of the block > max block size, it directly releases the memory in kernel.
-    if (block_get_size_curr(block) > BLOCK_SIZE_MAX) {
-        kernel_free(block, block_get_size_curr(block) + BLOCK_STRUCT_SIZE);
+    if (tcache_put(block)) {
+        return;
+    }
+
+    heap = block_heap(block);
+    lock_acquire(&heap->lock);
+    if (!small_bin_push(heap, block, ALLOCATOR_SMALL_BIN_COUNT)) {
+        block_release(block);
+    }
+    lock_release(&heap->lock);
+}
+
+/* Function large_aligned_alloc() allocates a block with an aligned payload directly from the kernel.
+ * The block starts as far into the mapping as its alignment requires, up to a page;
+ * larger alignments are served by mapping the memory at an aligned address. */
+static void *large_aligned_alloc(size_t alignment, size_t size) {
+    size_t payload_offset, arena_size, page_size;
+    char *arena;
+    Block *block;
+
+    // Offset of the payload from the start of the mapping, a mapping is always page aligned
+    page_size = kernel_page_size();
+    payload_offset = alignment < page_size ? alignment : page_size;
+    if (size > BLOCK_SIZE_MAX) {
+        return NULL;	// The size would not fit into the header, return NULL
+    }
+    arena_size = ROUND(payload_offset - ALIGN + BLOCK_SIZE_ROUND(size) + ARENA_OVERHEAD, page_size);
+    if (alignment <= page_size) {
+        arena = kernel_alloc(arena_size);
     } else {
-	// Otherwise, perform block merging and add the block to the tree
-        if (!block_get_flag_last(block)) {
-            block_r = block_next(block);
-	    // If the block is not the last block in the arena, attempt to merge with the next block
-            if (!block_get_flag_busy(block_r)) {
-                tree_remove_block(block_r);
-                block_merge(block, block_r);
-            }
-        }
-	// If the block is not the first block  in the arena, attempt to merge with the previous block
-        if (!block_get_flag_first(block)) {
-            block_l = block_prev(block);
-            if (!block_get_flag_busy(block_l)) {
-                tree_remove_block(block_l);
-                block_merge(block_l, block);
-		
-		// Update block pointer to the merged block
-                block = block_l;
-            }
-        }
+        arena = kernel_alloc_aligned(arena_size, alignment, payload_offset);
+    }
+    if (arena == NULL) {
+        return NULL;
+    }
 
-	// If the block is both the first and last block in the arena, free the entire arena
-        if (block_get_flag_first(block) && block_get_flag_last(block)) {
-            kernel_free(block, ARENA_SIZE);
-        } else {
-	    // Otherwise, trim meory and add the block back to the tree
-            block_dontneed(block);
-            tree_add_block(block);
-        }
+    block = arena_init(arena + payload_offset - ALIGN, arena_size - (payload_offset - ALIGN), heap_index(heap_get()));
+    arena_set_gap(block, payload_offset - ALIGN);
+    block_set_flag_mapped(block);
+    block_set_flag_busy(block);
+    atomic_fetch_add_explicit(&large_bytes, arena_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&large_count, 1, memory_order_relaxed);
+    return block_to_payload(block);
+}
+
+/* Function heap_aligned_alloc() allocates memory whose address is a multiple of alignment (a power of two).
+ * It takes a free block large enough for the requested size and the worst case gap in front of the aligned payload,
+ * the gap is split off as a free block of its own and the unused tail goes back to the tree.
+ * Sizes that do not fit into an arena together with the gap are allocated directly from the kernel.
+ * It returns NULL if alignment is not a power of two or there is no memory. */
+static void *heap_aligned_alloc(size_t alignment, size_t size) {
+    struct heap *heap;
+    Block *block, *block_a, *block_r;
+    uintptr_t payload, payload_a;
+    size_t size_need;
+
+    // An alignment beyond the largest block could not be served and would overflow the size needed for it
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > BLOCK_SIZE_MAX) {
+        return NULL;
     }
+    if (alignment <= ALIGN) {
+        return heap_alloc(size);
+    }
+    heap = heap_get();
+    if (size > heap_block_max(heap)) {
+        return large_aligned_alloc(alignment, size);
+    }
+    if (size < BLOCK_SIZE_MIN) {
+        size = BLOCK_SIZE_MIN;
+    }
+    size = BLOCK_SIZE_ROUND(size);
+
+    // A gap in front of the aligned payload is either empty or holds a free block
+    size_need = size + BLOCK_STRUCT_SIZE + BLOCK_SIZE_MIN + alignment - ALIGN;
+    if (size_need > heap_block_max(heap)) {
+        return large_aligned_alloc(alignment, size);
+    }
+
+    lock_acquire(&heap->lock);
+    block = heap_take(heap, size_need);
+    if (block == NULL) {
+        lock_release(&heap->lock);
+        return NULL;
+    }
+
+    payload = (uintptr_t)block_to_payload(block);
+    if ((payload & (alignment - 1)) != 0) {
+	// Split off the gap in front of the aligned payload and give it back as a free block
+        payload_a = ROUND(payload + BLOCK_STRUCT_SIZE + BLOCK_SIZE_MIN, (uintptr_t)alignment);
+        block_a = block_split(block, (size_t)(payload_a - payload) - BLOCK_STRUCT_SIZE);
+        block_set_flag_busy(block_a);
+        block_update_tag(block_a);
+        block_release(block);
+        block = block_a;
+    }
+
+    // Give back the tail that is not needed
+    block_r = block_split(block, size);
+    if (block_r != NULL) {
+        block_release(block_r);
+    }
+    lock_release(&heap->lock);
+    return block_to_payload(block);
+}
+
+/* Function heap_calloc() allocates zero-filled memory for an array of count elements of the given size.
+ * Blocks known to be clean are not cleared again: a block allocated directly from the kernel is left as is,
+ * a block of an arena is cleared only outside the whole pages its 'clean' flag refers to.
+ * It returns NULL if count * size overflows or there is no memory. */
+static void *heap_calloc(size_t count, size_t size) {
+    Block *block;
+    uintptr_t start, end, clean_start, clean_end;
+    void *ptr;
+
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;	// Overflow, return NULL
+    }
+    size *= count;
+
+    ptr = heap_alloc(size);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    block = payload_to_block(ptr);
+
+    // Blocks of thread caches and small bins have been used before, their 'clean' flag is stale
+    if (block_get_size_curr(block) <= ALLOCATOR_SMALL_SIZE_MAX || block_get_size_curr(block) <= ALLOCATOR_TCACHE_SIZE_MAX
+            || !block_get_flag_clean(block)) {
+        memset(ptr, 0, size);
+        return ptr;
+    }
+    if (block_get_flag_mapped(block)) {
+        return ptr;
+    }
+
+    start = (uintptr_t)ptr;
+    end = start + size;
+    block_clean_range(block, &clean_start, &clean_end);
+    if (clean_start >= clean_end || clean_start >= end) {
+        memset(ptr, 0, size);
+        return ptr;
+    }
+    memset(ptr, 0, clean_start - start);
+    if (clean_end < end) {
+        memset((void *)clean_end, 0, end - clean_end);
+    }
+    return ptr;
 }
 
+/* Function large_realloc() resizes a block allocated directly from the kernel by resizing its mapping,
+ * so the contents are never copied: the kernel moves the pages if the mapping cannot grow where it is.
+ * Like any realloc(), it keeps the payload aligned only to ALIGN. It takes the block and its new aligned size as parameters
+ * and returns the payload of the resized block, or NULL if the mapping could not be resized. */
+static void *large_realloc(Block *block, size_t size) {
+    size_t gap, page_size, size_old, size_new;
+    char *arena;
 
-/* Function mem_realloc() resizes tje memory block pointed to bu ptr1 to the specified size.
- * If the ptr1 is NULL, then the function call mem_alloc() function.
- * If requested size = current size, but the current size is > max block size, then allocate a new block
- * of the requested size and copy contents of the old block to the new one before freeing the old block.
- * Otherwise, just return the pt1 as is.
+    gap = arena_get_gap(block);
+    page_size = kernel_page_size();
+    if (size > BLOCK_SIZE_MAX) {
+        return NULL;	// The size would not fit into the header, return NULL
+    }
+    size_old = gap + block_get_size_curr(block) + ARENA_OVERHEAD;
+    size_new = ROUND(gap + size + ARENA_OVERHEAD, page_size);
+    if (size_new != size_old) {
+        arena = kernel_realloc((char *)block_to_arena(block) - gap, size_old, size_new);
+        if (arena == NULL) {
+            return NULL;
+        }
+	// The header and the gap moved together with the pages
+        block = arena_to_block(arena + gap);
+        block_set_size_curr(block, size_new - ARENA_OVERHEAD - gap);
+        atomic_fetch_add_explicit(&large_bytes, size_new - size_old, memory_order_relaxed);	// Wraps around on shrink
+    }
+    return block_to_payload(block);
+}
+
+/* Function heap_realloc() resizes tje memory block pointed to bu ptr1 to the specified size.
+ * If the ptr1 is NULL, then the function call heap_alloc() function.
+ * If the block has been allocated directly from the kernel, its mapping is resized without copying.
+ * Only if that fails, allocate a new block of the requested size and copy contents of the old block
+ * to the new one before freeing the old block.
+ * If requested size < current size, the block is split in place, also if it is the last one in its arena,
+ * and the rest goes back to the tree of the heap.
  * If requested size > current size, the function will try to expand the block in place.
  * If there is enough space in adjacent block, then it will merge tham and split the newly merged block.
- * If there is not enough space even in adjacent block, it allocates a new block and copies contents,
+ * If the previous block is free, the block grows into it (and into the next block if it is free too)
+ * and the contents are moved to the start of the merged block, which keeps the heap from fragmenting.
+ * If there is not enough space even in adjacent blocks, it allocates a new block and copies contents,
  * before freeing the old block
  */
-void* mem_realloc(void* ptr1, size_t size) {
+static void *heap_realloc(void* ptr1, size_t size) {
+    struct heap *heap;
     void *ptr2;
-    Block* block1, *block_r, *block_n;
+    Block* block1, *block_l, *block_r, *block_n;
     size_t size_curr;
 
+    // The size would not fit into the header and would overflow when rounded up, the block is left as is
+    if (size > BLOCK_SIZE_MAX) {
+        return NULL;
+    }
+
+    // An object of a slab cannot grow, it is moved into a block if it does not fit
+    if (ptr1 != NULL && slab_owns(ptr1)) {
+        size_curr = slab_object_size(ptr1);
+        if (size <= size_curr) {
+            slab_unsample(ptr1);	// Counted as a new allocation like a block that stays in place
+            return ptr1;
+        }
+        goto move_large_block;
+    }
+
     // Make the requested size at least possble minimum
     if (size < BLOCK_SIZE_MIN) {
         size = BLOCK_SIZE_MIN;
     }
 
-    size = ROUND_BYTES(size);
+    size = BLOCK_SIZE_ROUND(size);
 
     // If ptr1 is NULL, allocate a new memory block of the given size
     if (ptr1 == NULL) {
-        return mem_alloc(size);
+        return heap_alloc(size);
     }
 
     block1 = payload_to_block(ptr1);
+
+    // The block may move or grow, the heap profiler forgets it and counts the result as a new allocation
+    if (block_get_flag_sampled(block1)) {
+        block_unsample(block1);
+    }
     size_curr = block_get_size_curr(block1);
 
-    // If the current block size exceeds the maximum block size
-    if (size_curr > BLOCK_SIZE_MAX) {
+    // If the block has been allocated directly from the kernel
+    if (block_get_flag_mapped(block1)) {
 	// If the requested size is the same as the current size, return ptr1
         if (size == size_curr) {
             return ptr1;
         }
-	// Allocate a new block and move the contents
+	// Grow or shrink the mapping, allocate a new block and move the contents if that fails
+        ptr2 = large_realloc(block1, size);
+        if (ptr2 != NULL) {
+            return ptr2;
+        }
         goto move_large_block;
     }
 
@@ -232,12 +1130,19 @@ void* mem_realloc(void* ptr1, size_t size) {
         return ptr1;
     }
 
-    // If the requested size is smaller than current size, then decrease the size of the block
+    // Neighbouring blocks may be changed by other threads, resize in place under the lock of the heap
+    heap = block_heap(block1);
+    lock_acquire(&heap->lock);
+
+    // The block holds data of the program, neither it nor a block split off from it is clean
+    block_clr_flag_clean(block1);
+
+    // If the requested size is smaller than current size, then decrease the size of the block in place
     if (size < size_curr) {
-        if (!block_get_flag_last(block1)) {
-	    // Split the block to the requested size
-            block_r = block_split(block1, size);
-            if (block_r != NULL) {
+	// Split the block to the requested size, the last block of an arena as well
+        block_r = block_split(block1, size);
+        if (block_r != NULL) {
+            if (!block_get_flag_last(block_r)) {
                 block_n = block_next(block_r);
                 if (!block_get_flag_busy(block_n)) {
 		    // Remove next block from tree
@@ -246,39 +1151,394 @@ void* mem_realloc(void* ptr1, size_t size) {
 		    // Merge blocks
                     block_merge(block_r, block_n);
                 }
-
-		// Add ne block to the tree
-                tree_add_block(block_r);
-                return block_to_payload(block1);    // Return payload pointer of the original block
             }
+
+	    // Add ne block to the tree, its pages are given back like those of any free block
+            tree_add_block(block_r);
+            heap_trim_check(heap);
         }
+	// A rest too small for a block of its own stays in the block
+        lock_release(&heap->lock);
+        return block_to_payload(block1);    // Return payload pointer of the original block
     }
 
     // If the requested size is bigger than the current size, then increase the block size
     if (size > size_curr) {
-        if (!block_get_flag_last(block1)) {
+        size_t total_size = size_curr;
+
+        block_r = NULL;
+        if (!block_get_flag_last(block1) && !block_get_flag_busy(block_next(block1))) {
             block_r = block_next(block1);
-            if (!block_get_flag_busy(block_r)) {
-                size_t total_size = size_curr + block_get_size_curr(block_r) + BLOCK_STRUCT_SIZE;
-                if (total_size >= size) {
+            total_size += block_get_size_curr(block_r) + BLOCK_STRUCT_SIZE;
+            if (total_size >= size) {
+                tree_remove_block(block_r);
+                block_merge(block1, block_r);
+                block_n = block_split(block1, size);
+                if (block_n != NULL) {
+                    tree_add_block(block_n);
+                }
+                lock_release(&heap->lock);
+                return block_to_payload(block1);
+            }
+        }
+
+	// Grow into the free previous block (and the next one if it is free too), moving the contents down
+        if (block_get_flag_prev_free(block1)) {
+            block_l = block_prev(block1);
+            total_size += block_get_size_curr(block_l) + BLOCK_STRUCT_SIZE;
+            if (total_size >= size) {
+                tree_remove_block(block_l);
+                if (block_r != NULL) {
                     tree_remove_block(block_r);
-                    block_merge(block1, block_r);
-                    block_n = block_split(block1, size);
-                    if (block_n != NULL) {
-                        tree_add_block(block_n);
-                    }
-                    return block_to_payload(block1);
                 }
+		// The merged block is busy from the start, so no footer is written over the contents
+                block_set_flag_busy(block_l);
+                block_clr_flag_busy(block1);
+                block_merge(block_l, block1);
+                if (block_r != NULL) {
+                    block_merge(block_l, block_r);
+                }
+                ptr2 = block_to_payload(block_l);
+                memmove(ptr2, ptr1, size_curr);
+                block_n = block_split(block_l, size);
+                if (block_n != NULL) {
+                    tree_add_block(block_n);
+                }
+                lock_release(&heap->lock);
+                return ptr2;
             }
         }
     }
+    lock_release(&heap->lock);
 
 move_large_block:
-    ptr2 = mem_alloc(size);	// Allocate a new block of requested size
+    ptr2 = heap_alloc(size);	// Allocate a new block of requested size
     if (ptr2 != NULL) {
 	// Copy contents of the old block to the new block and free the old block
         memcpy(ptr2, ptr1, size_curr < size ? size_curr : size);
-        mem_free(ptr1);
+        heap_free(ptr1);
     }
     return ptr2;    // Return the pointer to the new memory block
 }
+
+/* Functions mem_alloc(), mem_free(), mem_aligned_alloc(), mem_calloc() and mem_realloc() call the functions above
+ * and record the calls while tracing is on, see mem_trace_start(). Calls between the functions above
+ * are not recorded, a traced program sees one record per call it made.
+ * The allocating ones count the bytes for the heap profiler too, see mem_prof_start(). */
+void *mem_alloc(size_t size) {
+    void *ptr = heap_alloc(size);
+
+    if (prof_due(size)) {
+        block_sample(ptr, size);
+    }
+    if (trace_on()) {
+        trace_record(MEM_TRACE_ALLOC, ptr, 0, size);
+    }
+    return ptr;
+}
+
+void mem_free(void *ptr) {
+    // The record goes first, the memory may be allocated again by another thread as soon as it is freed
+    if (trace_on() && ptr != NULL) {
+        trace_record(MEM_TRACE_FREE, ptr, 0, 0);
+    }
+    heap_free(ptr);
+}
+
+void *mem_aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = heap_aligned_alloc(alignment, size);
+
+    if (prof_due(size)) {
+        block_sample(ptr, size);
+    }
+    if (trace_on()) {
+        trace_record(MEM_TRACE_ALIGNED_ALLOC, ptr, alignment, size);
+    }
+    return ptr;
+}
+
+void *mem_calloc(size_t count, size_t size) {
+    void *ptr = heap_calloc(count, size);
+
+    // An overflowing count * size has failed, its product does not matter
+    if (prof_due(count * size)) {
+        block_sample(ptr, count * size);
+    }
+    if (trace_on()) {
+        trace_record(MEM_TRACE_CALLOC, ptr, count, size);
+    }
+    return ptr;
+}
+
+void *mem_realloc(void *ptr1, size_t size) {
+    void *ptr2 = heap_realloc(ptr1, size);
+
+    if (prof_due(size)) {
+        block_sample(ptr2, size);
+    }
+    if (trace_on()) {
+        trace_record(MEM_TRACE_REALLOC, ptr1, (uintptr_t)ptr2, size);
+    }
+    return ptr2;
+}
+
+/* Function mem_set_poison() turns poisoning of freed memory on or off.
+ * The initial setting is ALLOCATOR_POISON, it may be changed at any time. */
+void mem_set_poison(bool enable) {
+    atomic_store_explicit(&poison, enable, memory_order_relaxed);
+}
+
+/* Function mem_set_release() chooses how memory of free blocks is given back to the kernel from now on.
+ * It overrides the MEM_RELEASE environment variable. */
+void mem_set_release(enum mem_release strategy) {
+    once_call(&heaps_once, heaps_init);
+    atomic_store_explicit(&release, (int)strategy, memory_order_relaxed);
+}
+
+/* Function mem_set_huge_pages() chooses whether new arenas are backed with huge pages.
+ * Arenas mapped before keep their pages. It overrides the MEM_HUGE_PAGES environment variable. */
+void mem_set_huge_pages(bool enable) {
+    once_call(&heaps_once, heaps_init);
+    atomic_store_explicit(&huge_pages, enable, memory_order_relaxed);
+}
+
+/* Function mem_set_arena_size() sets the size of the first arena of a heap and the size
+ * the arenas of a heap stop growing at, both are rounded up to whole pages.
+ * Heaps whose arenas have grown beyond the new max size continue with arenas of the max size.
+ * Requests larger than the max block size of the heap are allocated directly from the kernel from now on. */
+void mem_set_arena_size(size_t size_min, size_t size_max) {
+    size_t page_size = kernel_page_size();
+
+    once_call(&heaps_once, heaps_init);
+    if (size_min < page_size) {
+        size_min = page_size;
+    }
+    if (size_max < size_min) {
+        size_max = size_min;
+    }
+    // Arenas are blocks too, their size must fit into the header
+    if (size_max > BLOCK_SIZE_MAX) {
+        size_max = BLOCK_SIZE_MAX;
+        size_min = size_min < size_max ? size_min : size_max;
+    }
+    atomic_store_explicit(&arena_size_min, ROUND(size_min, page_size), memory_order_relaxed);
+    atomic_store_explicit(&arena_size_max, ROUND(size_max, page_size), memory_order_relaxed);
+}
+
+/* Function mem_trim() gives the pages of every free block of all heaps and every cached empty arena
+ * back to the kernel right away, instead of waiting for the trim threshold or the decay time.
+ * Blocks cached by the calling thread and the small bins go back to the trees first, so arenas they keep
+ * from being empty are freed as well. Caches of other threads are left alone. It returns the number of bytes given back. */
+size_t mem_trim(void) {
+    size_t released = 0;
+
+    once_call(&heaps_once, heaps_init);
+    tcache_flush();
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        lock_acquire(&heaps[i].lock);
+        heap_bins_release(&heaps[i]);
+        released += heap_trim(&heaps[i], 0);
+        lock_release(&heaps[i].lock);
+    }
+    lock_acquire(&arena_cache_lock);
+    released += arena_cache_trim(true);
+    lock_release(&arena_cache_lock);
+    return released;
+}
+
+/* Output of a heap dump: words are collected in a small buffer and written out when it is full,
+ * or copied straight into the buffer of the caller. Nothing is allocated. */
+struct dump_out {
+    int fd;			// File descriptor to write to, -1 to copy into buf
+    char *buf;
+    size_t size;		// Size of buf
+    size_t total;		// Bytes of the whole dump so far, also those that did not fit into buf
+    bool failed;		// A write to fd has failed
+    size_t count;		// Number of words collected in words
+    uint64_t words[64];
+};
+
+// Function that writes out the words collected for the file descriptor
+static void dump_flush(struct dump_out *out) {
+    if (out->count != 0 && !out->failed) {
+        out->failed = !kernel_write(out->fd, out->words, out->count * sizeof(out->words[0]));
+    }
+    out->count = 0;
+}
+
+// Function that appends a word to a heap dump
+static void dump_word(struct dump_out *out, uint64_t word) {
+    if (out->fd < 0) {
+        if (out->total <= out->size && out->size - out->total >= sizeof(word)) {
+            memcpy(out->buf + out->total, &word, sizeof(word));
+        }
+    } else {
+        out->words[out->count++] = word;
+        if (out->count == sizeof(out->words) / sizeof(out->words[0])) {
+            dump_flush(out);
+        }
+    }
+    out->total += sizeof(word);
+}
+
+/* Function heap_dump() appends every arena of the heap with all of its blocks to a heap dump.
+ * The lock of the heap is only tried: in a signal handler it may be held by the interrupted thread,
+ * so a heap whose lock stays held for DUMP_LOCK_TRIES attempts is recorded as skipped. */
+static void heap_dump(struct heap *heap, struct dump_out *out) {
+    uint64_t tag, flags;
+    unsigned int tries;
+    void *arena;
+    Block *block;
+
+    tag = (uint64_t)heap_index(heap) << MEM_DUMP_HEAP_SHIFT;
+    for (tries = 0; !lock_try(&heap->lock); ++tries) {
+        if (tries == DUMP_LOCK_TRIES) {
+            dump_word(out, MEM_DUMP_SKIPPED | tag);
+            return;
+        }
+    }
+    for (arena = heap->arena_list; arena != NULL; arena = *arena_link(arena)) {
+        block = arena_to_block(arena);
+        dump_word(out, MEM_DUMP_ARENA | tag | (block_get_flag_huge(block) ? MEM_DUMP_HUGE : 0));
+        dump_word(out, (uintptr_t)block);
+        for (; ; block = block_next(block)) {
+            flags = (block_get_flag_busy(block) ? MEM_DUMP_BUSY : 0)
+                    | (block_get_flag_last(block) ? MEM_DUMP_LAST : 0)
+                    | (block_get_flag_clean(block) ? MEM_DUMP_CLEAN : 0)
+                    | (block_get_flag_binned(block) ? MEM_DUMP_BINNED : 0);
+            dump_word(out, (block_get_size_curr(block) + BLOCK_STRUCT_SIZE) | flags);
+            if (block_get_flag_last(block)) {
+                break;
+            }
+        }
+    }
+    lock_release(&heap->lock);
+}
+
+// Function that produces a heap dump of all heaps, see allocator.h for the format
+static void dump(struct dump_out *out) {
+    once_call(&heaps_once, heaps_init);
+    dump_word(out, MEM_DUMP_MAGIC);
+    dump_word(out, kernel_page_size());
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        heap_dump(&heaps[i], out);
+    }
+    dump_word(out, MEM_DUMP_END);
+    dump_word(out, atomic_load_explicit(&large_count, memory_order_relaxed));
+    dump_word(out, atomic_load_explicit(&large_bytes, memory_order_relaxed));
+}
+
+/* Function mem_dump() copies a heap dump into the buffer of the given size.
+ * It returns the size of the whole dump, if that is more than the size of the buffer, the dump has been cut short.
+ * Nothing is allocated and no heap lock is waited for, so it may be called from a signal handler. */
+size_t mem_dump(void *buf, size_t size) {
+    struct dump_out out = { .fd = -1, .buf = buf, .size = size };
+
+    dump(&out);
+    return out.total;
+}
+
+/* Function mem_dump_fd() writes a heap dump to the file descriptor, a heap at a time, with the lock of the heap held.
+ * Like mem_dump(), it may be called from a signal handler. It returns false if a write failed. */
+bool mem_dump_fd(int fd) {
+    struct dump_out out = { .fd = fd };
+
+    if (fd < 0) {
+        return false;
+    }
+    dump(&out);
+    dump_flush(&out);
+    return !out.failed;
+}
+
+/* Function mem_stats() fills the statistics of all heaps, the cache of empty arenas and blocks
+ * allocated directly from the kernel. Heaps are locked one at a time, so the numbers of different heaps
+ * may be taken at slightly different moments. Slabs of mem_slab_create() are not counted.
+ * No block is visited: the heaps keep the counters up to date. The largest free block of a heap is the rightmost node
+ * of its tree, reached by going down the right edge of the tree, that is O(log n) steps in a tree of n sizes. */
+void mem_stats(struct mem_stats *stats) {
+    struct heap *heap;
+    tree_node_type *node;
+    size_t size;
+
+    memset(stats, 0, sizeof(*stats));
+    once_call(&heaps_once, heaps_init);
+    for (heap = heaps; heap < heaps + ALLOCATOR_HEAPS; ++heap) {
+        lock_acquire(&heap->lock);
+        stats->mapped += heap->arena_bytes;
+        stats->arenas += heap->arenas;
+	// Blocks of an arena take all of it but ARENA_OVERHEAD - BLOCK_STRUCT_SIZE bytes
+        stats->busy += heap->arena_bytes - heap->arenas * (ARENA_OVERHEAD - BLOCK_STRUCT_SIZE)
+                       - heap->free_bytes - heap->bin_bytes;
+        stats->free += heap->free_bytes;
+        stats->cached += heap->bin_bytes;
+        node = tree_find_max(&heap->blocks_tree);
+        if (node != NULL) {
+            size = block_get_size_curr(node_to_block(node)) + BLOCK_STRUCT_SIZE;
+            if (size > stats->largest_free) {
+                stats->largest_free = size;
+            }
+        }
+        for (unsigned int i = 0; i < MEM_STATS_CLASSES; ++i) {
+            stats->free_classes[i] += heap->free_classes[i];
+        }
+        lock_release(&heap->lock);
+    }
+
+    lock_acquire(&arena_cache_lock);
+    stats->mapped += arena_cache_bytes;
+    stats->cached += arena_cache_bytes;
+    lock_release(&arena_cache_lock);
+
+    size = atomic_load_explicit(&large_bytes, memory_order_relaxed);
+    stats->mapped += size;
+    stats->busy += size;
+    stats->large = atomic_load_explicit(&large_count, memory_order_relaxed);
+
+    if (stats->free != 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / (double)stats->free;
+    }
+}
+
+/* Function mem_usable_size() returns the number of bytes that can be used at ptr.
+ * It is never less than the size the memory was allocated with, 0 is returned for NULL. */
+size_t mem_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (slab_owns(ptr)) {
+        return slab_object_size(ptr);
+    }
+    return block_get_size_curr(payload_to_block(ptr));
+}
+
+/* Functions mem_fork_prepare(), mem_fork_parent() and mem_fork_child() are meant for pthread_atfork().
+ * Every heap lock is taken before fork(), so the child never inherits a heap
+ * in the middle of an update made by a thread that does not exist in the child.
+ * Locks of slabs are not taken, a slab must not be used across fork() by several threads. */
+void mem_fork_prepare(void) {
+    once_call(&heaps_once, heaps_init);
+    prof_fork_prepare();
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        lock_acquire(&heaps[i].lock);
+    }
+    lock_acquire(&arena_cache_lock);
+}
+
+void mem_fork_parent(void) {
+    lock_release(&arena_cache_lock);
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        lock_release(&heaps[i].lock);
+    }
+    prof_fork_parent();
+}
+
+// The child has only the thread that called fork(), so the locks are simply initialized again
+void mem_fork_child(void) {
+    trace_fork_child();
+    prof_fork_child();
+    lock_init(&arena_cache_lock);
+    for (unsigned int i = 0; i < ALLOCATOR_HEAPS; ++i) {
+        lock_init(&heaps[i].lock);
+    }
+}
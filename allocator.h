@@ -1,4 +1,118 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 void *mem_alloc(size_t);
+void *mem_aligned_alloc(size_t, size_t);
+void *mem_calloc(size_t, size_t);
 void mem_free(void *);
 void *mem_realloc(void *, size_t);
 void mem_show(const char *);
+size_t mem_usable_size(void *);
+void mem_set_poison(bool);
+size_t mem_trim(void);
+
+/* How memory of free blocks is given back to the kernel. The initial strategy comes from
+ * the MEM_RELEASE environment variable (dontneed, free, munmap or none), MEM_RELEASE_DONTNEED without it.
+ * Pages kept under one strategy are given back later if it is changed to one that drops them. */
+enum mem_release {
+    MEM_RELEASE_DONTNEED,	// Pages are dropped with MADV_DONTNEED and read back as zeros
+    MEM_RELEASE_FREE,		// Pages are dropped with MADV_FREE, the kernel takes them only under memory pressure
+    MEM_RELEASE_MUNMAP,		// Pages of free blocks are kept, only arenas that become empty are unmapped
+    MEM_RELEASE_NONE,		// Nothing is given back, empty arenas are kept for reuse
+};
+void mem_set_release(enum mem_release);
+void mem_set_arena_size(size_t, size_t);
+void mem_set_huge_pages(bool);
+
+/* Statistics of the allocator filled by mem_stats(). Sizes are in bytes, blocks are counted with their headers.
+ * Blocks held in caches of threads count as busy. */
+#define MEM_STATS_CLASSES 24	// Class i holds blocks of 2^(i+4) to 2^(i+5)-1 bytes, the last one all larger blocks
+struct mem_stats {
+    size_t mapped;		// Memory mapped from the kernel for arenas, cached empty arenas and large blocks
+    size_t busy;		// Busy blocks of arenas and blocks allocated directly from the kernel
+    size_t free;		// Free blocks in the trees of the heaps
+    size_t cached;		// Free small blocks in bins of the heaps and empty arenas kept for reuse
+    size_t arenas;		// Number of arenas in use
+    size_t large;		// Number of blocks allocated directly from the kernel
+    size_t largest_free;	// Largest free block in a tree
+    size_t free_classes[MEM_STATS_CLASSES];	// Number of free blocks in the trees by size class
+    double fragmentation;	// External fragmentation, 1 - largest_free / free (0 without free blocks)
+};
+void mem_stats(struct mem_stats *);
+
+/* Heap dump of mem_dump() and mem_dump_fd(), a stream of 64-bit words in native byte order:
+ *     MEM_DUMP_MAGIC, page size
+ *     for every arena of every heap, heaps in order:
+ *         MEM_DUMP_ARENA | heap index << MEM_DUMP_HEAP_SHIFT [| MEM_DUMP_HUGE], address of the first block,
+ *         one word per block in address order: size of the block with its header | MEM_DUMP_* flags of the block,
+ *         up to the block with MEM_DUMP_LAST
+ *     or for a heap whose lock stayed held: MEM_DUMP_SKIPPED | heap index << MEM_DUMP_HEAP_SHIFT
+ *     MEM_DUMP_END, number of blocks allocated directly from the kernel, bytes mapped for them
+ * Blocks in bins are busy and MEM_DUMP_BINNED, blocks in caches of threads are just busy. */
+#define MEM_DUMP_MAGIC UINT64_C(0x31504d5544434f4c)	// "LOCDUMP1"
+#define MEM_DUMP_ARENA 0x1
+#define MEM_DUMP_SKIPPED 0x2
+#define MEM_DUMP_END 0x3
+#define MEM_DUMP_HUGE 0x80	// The arena is backed with huge pages
+#define MEM_DUMP_HEAP_SHIFT 8
+#define MEM_DUMP_BUSY 0x1
+#define MEM_DUMP_LAST 0x2
+#define MEM_DUMP_CLEAN 0x4	// Whole pages of the free block are known to be zero
+#define MEM_DUMP_BINNED 0x8
+size_t mem_dump(void *, size_t);
+bool mem_dump_fd(int);
+
+/* Tracing of the calls of mem_alloc(), mem_calloc(), mem_aligned_alloc(), mem_realloc() and mem_free().
+ * mem_trace_start() writes MEM_TRACE_MAGIC to the file descriptor, then the records go there in batches
+ * as a background thread collects them from ring buffers of the threads; records of different threads
+ * are not in order, sort them by time. A record that finds the ring buffer of its thread full is lost,
+ * mem_trace_stop() writes all that is left and a MEM_TRACE_LOST record with the number of lost records.
+ * The file descriptor stays open. */
+#define MEM_TRACE_MAGIC UINT64_C(0x4543415254434f4c)	// "LOCTRACE"
+enum mem_trace_op {
+    MEM_TRACE_ALLOC,
+    MEM_TRACE_CALLOC,
+    MEM_TRACE_ALIGNED_ALLOC,
+    MEM_TRACE_REALLOC,
+    MEM_TRACE_FREE,
+    MEM_TRACE_LOST,
+};
+struct mem_trace_record {
+    uint64_t time;	// Nanoseconds of CLOCK_MONOTONIC, taken before mem_free() and after the other calls
+    uint64_t ptr;	// Pointer passed to mem_realloc() and mem_free(), returned by the others
+    uint64_t result;	// Pointer returned by mem_realloc(), count of mem_calloc(), alignment of mem_aligned_alloc()
+    uint64_t size;	// Size requested, number of lost records for MEM_TRACE_LOST
+    uint32_t thread;	// Threads are numbered from 1 in the order of their first traced call
+    uint32_t op;	// enum mem_trace_op
+};
+bool mem_trace_start(int);
+void mem_trace_stop(void);
+
+/* Sampling heap profiler. While it runs, an allocation is sampled every given number of bytes allocated
+ * on average (0 for ALLOCATOR_PROF_INTERVAL), the points are drawn from an exponential distribution,
+ * so large allocations are sampled more often than small ones in proportion to their size.
+ * A sampled block keeps the call stack of its allocation until it is freed or reallocated.
+ * mem_prof_dump() writes the stacks of the live sampled blocks:
+ * MEM_PROF_PPROF as a legacy heap profile of gperftools that 'pprof' reads together with the program,
+ * MEM_PROF_FOLDED as one 'frame;frame;... bytes' line per block for flame graphs, with bytes scaled up
+ * to the estimated live bytes the sample stands for. Stopping keeps the samples of live blocks. */
+enum mem_prof_format {
+    MEM_PROF_PPROF,
+    MEM_PROF_FOLDED,
+};
+void mem_prof_start(size_t);
+void mem_prof_stop(void);
+bool mem_prof_dump(int, enum mem_prof_format);
+
+/* Handlers for pthread_atfork() that keep the heaps consistent in a child of a multithreaded process. */
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+
+/* Slabs of fixed-size objects without per-object headers.
+ * Objects of a slab are released with mem_free() like any other memory. */
+struct mem_slab;
+struct mem_slab *mem_slab_create(size_t);
+void *mem_slab_alloc(struct mem_slab *);
+void mem_slab_destroy(struct mem_slab *);
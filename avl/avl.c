@@ -708,6 +708,22 @@ avl_find_best(struct avl_tree *tree, size_t key)
 	return node;
 }
 
+/*
+ * Return the node with the largest key, the rightmost one.
+ * The right edge of the tree is followed down, O(log n) steps.
+ */
+struct avl_node *
+avl_last(const struct avl_tree *tree)
+{
+	struct avl_node *node;
+
+	node = tree->avl_root;
+	if (node != NULL)
+		while (node->avl_child[1] != NULL)
+			node = node->avl_child[1];
+	return node;
+}
+
 static void
 avl_walk_impl(const struct avl_node *node1, void (*func)(const struct avl_node *, bool))
 {
@@ -199,6 +199,7 @@ extern void avl_remove(avl_tree_t *tree, struct avl_node *node);
 extern bool avl_is_empty(avl_tree_t *tree);
 
 struct avl_node *avl_find_best(struct avl_tree *tree, size_t key);
+struct avl_node *avl_last(const struct avl_tree *tree);
 void avl_walk(const struct avl_tree *tree,
     void (*func)(const struct avl_node *, bool));
 
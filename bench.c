@@ -0,0 +1,695 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "allocator.h"
+
+/* Benchmark of mem_alloc()/mem_free()/mem_realloc().
+ * Every workload is replayed by a number of threads, every call is timed and its latency
+ * goes into a log-linear histogram of the thread. The report shows throughput, latency
+ * percentiles per operation, peak RSS and fragmentation (share of resident memory
+ * not holding live data at the end of the workload), optionally next to glibc malloc
+ * and next to mem_alloc() poisoning freed memory, which shows the cost of poisoning on the free path.
+ * Page faults of every run are counted, so release strategies (-r) can be compared.
+ * The access workload touches a large working set at random, its throughput and dTLB misses
+ * (where perf events are available) compare arenas backed with huge pages (-H) to normal ones. */
+
+struct allocator {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*free)(void *);
+    void *(*realloc)(void *, size_t);
+    bool poison;	// mem_alloc() with poisoning of freed memory
+    bool huge;		// mem_alloc() with arenas backed with huge pages
+    bool libc;
+};
+
+static const struct allocator allocators[] = {
+    { "mem_alloc", mem_alloc, mem_free, mem_realloc, false, false, false },
+    { "mem_alloc+poison", mem_alloc, mem_free, mem_realloc, true, false, false },
+    { "mem_alloc+huge", mem_alloc, mem_free, mem_realloc, false, true, false },
+    { "malloc", malloc, free, realloc, false, false, true },
+};
+
+enum op { OP_ALLOC, OP_FREE, OP_REALLOC, OP_NUM };
+
+static const char *const op_names[OP_NUM] = { "alloc", "free", "realloc" };
+
+/* Latency histogram: values below HIST_SUB are exact, above them every power of two
+ * is split into HIST_SUB buckets, so a bucket is at most 1/HIST_SUB of its value wide. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+};
+
+struct options {
+    const char *workload;
+    unsigned long ops;	// Operations per thread
+    unsigned int threads;
+    size_t size;	// Size of the fixed workload
+    size_t size_min;	// Sizes of the random and realloc workloads
+    size_t size_max;
+    bool exp_sizes;	// Exponential instead of uniform size distribution
+    size_t slots;	// Live objects per thread
+    bool libc;		// Run every workload against malloc as well
+    bool poison;	// Run every workload against mem_alloc() with poisoning as well
+    bool huge;		// Run every workload against mem_alloc() with huge page arenas as well
+    int release;	// Release strategy of mem_alloc(), -1 for the default, RELEASE_ALL for every one
+};
+
+#define RELEASE_ALL (MEM_RELEASE_NONE + 1)
+
+static const char *const release_names[] = { "dontneed", "free", "munmap", "none" };
+
+struct worker {
+    const struct options *opt;
+    const struct allocator *a;
+    struct hist hist[OP_NUM];
+    size_t live;	// Bytes held by the worker at the end of its workload
+    uint64_t accesses;	// Memory accesses of the access workload
+    unsigned int seed;
+    struct ring *ring;	// Queue between a producer and a consumer
+    bool producer;	// Role in the producer/consumer workload
+    pthread_barrier_t *barrier;
+};
+
+// Single-producer single-consumer queue of pointers used by the producer/consumer workload
+#define RING_SIZE 1024
+
+struct ring {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    void *ptrs[RING_SIZE];
+};
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int
+hist_bucket(uint64_t value)
+{
+    unsigned int msb;
+
+    if (value < HIST_SUB)
+        return (unsigned int)value;
+    msb = 63u - (unsigned int)__builtin_clzll(value);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (unsigned int)(value >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+static uint64_t
+hist_value(unsigned int bucket)
+{
+    unsigned int msb;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(bucket % HIST_SUB + HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static inline void
+hist_add(struct hist *h, uint64_t value)
+{
+    ++h->count[hist_bucket(value)];
+    ++h->total;
+}
+
+static uint64_t
+hist_percentile(const struct hist *h, double p)
+{
+    uint64_t rank, seen = 0;
+    unsigned int bucket;
+
+    rank = (uint64_t)ceil(p * (double)h->total);
+    for (bucket = 0; bucket < HIST_BUCKETS; ++bucket) {
+        seen += h->count[bucket];
+        if (seen >= rank && seen != 0)
+            return hist_value(bucket);
+    }
+    return 0;
+}
+
+static size_t
+random_size(struct worker *w)
+{
+    const struct options *opt = w->opt;
+    double u;
+
+    u = (double)rand_r(&w->seed) / ((double)RAND_MAX + 1.0);
+    if (opt->exp_sizes) {
+        // Mean of an eighth of the range, most requests are small as in real programs
+        u = -log(1.0 - u) / 8.0;
+        if (u > 1.0)
+            u = 1.0;
+    }
+    return opt->size_min + (size_t)(u * (double)(opt->size_max - opt->size_min));
+}
+
+static void *
+timed_alloc(struct worker *w, size_t size)
+{
+    uint64_t t0;
+    void *ptr;
+
+    t0 = now_ns();
+    ptr = w->a->alloc(size);
+    hist_add(&w->hist[OP_ALLOC], now_ns() - t0);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s(%zu) failed\n", w->a->name, size);
+        exit(EXIT_FAILURE);
+    }
+    // Touch the memory as a real program would
+    *(volatile char *)ptr = 1;
+    return ptr;
+}
+
+static void
+timed_free(struct worker *w, void *ptr)
+{
+    uint64_t t0;
+
+    t0 = now_ns();
+    w->a->free(ptr);
+    hist_add(&w->hist[OP_FREE], now_ns() - t0);
+}
+
+static void *
+timed_realloc(struct worker *w, void *ptr, size_t size)
+{
+    uint64_t t0;
+
+    t0 = now_ns();
+    ptr = w->a->realloc(ptr, size);
+    hist_add(&w->hist[OP_REALLOC], now_ns() - t0);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s realloc(%zu) failed\n", w->a->name, size);
+        exit(EXIT_FAILURE);
+    }
+    ((volatile char *)ptr)[size - 1] = 1;
+    return ptr;
+}
+
+/* Fixed-size churn: a FIFO of live objects of one size, every step frees the oldest and allocates a new one. */
+static void
+workload_fixed(struct worker *w)
+{
+    void **slots;
+    size_t idx, n = w->opt->slots;
+
+    slots = calloc(n, sizeof(*slots));
+    for (idx = 0; idx < n; ++idx)
+        slots[idx] = timed_alloc(w, w->opt->size);
+    for (unsigned long i = 0; i < w->opt->ops; ++i) {
+        idx = i % n;
+        timed_free(w, slots[idx]);
+        slots[idx] = timed_alloc(w, w->opt->size);
+    }
+    w->live = n * w->opt->size;
+    pthread_barrier_wait(w->barrier);
+    for (idx = 0; idx < n; ++idx)
+        timed_free(w, slots[idx]);
+    free(slots);
+}
+
+/* Random sizes: a random slot is freed if it holds an object, otherwise an object of a random size is put there. */
+static void
+workload_random(struct worker *w)
+{
+    void **slots;
+    size_t *sizes;
+    size_t idx, n = w->opt->slots;
+
+    slots = calloc(n, sizeof(*slots));
+    sizes = calloc(n, sizeof(*sizes));
+    for (unsigned long i = 0; i < w->opt->ops; ++i) {
+        idx = (size_t)rand_r(&w->seed) % n;
+        if (slots[idx] != NULL) {
+            timed_free(w, slots[idx]);
+            slots[idx] = NULL;
+            w->live -= sizes[idx];
+        } else {
+            sizes[idx] = random_size(w);
+            slots[idx] = timed_alloc(w, sizes[idx]);
+            w->live += sizes[idx];
+        }
+    }
+    pthread_barrier_wait(w->barrier);
+    for (idx = 0; idx < n; ++idx)
+        if (slots[idx] != NULL)
+            timed_free(w, slots[idx]);
+    free(slots);
+    free(sizes);
+}
+
+/* Realloc growth: buffers grow from size_min to size_max, alternately by half of their size
+ * (vectors) and by size_min bytes (appending to a string), then they are freed. */
+static void
+workload_realloc(struct worker *w)
+{
+    void *ptr = NULL;
+    size_t size = 0;
+    bool geometric = true;
+
+    for (unsigned long i = 0; i < w->opt->ops; ++i) {
+        if (ptr == NULL) {
+            size = w->opt->size_min;
+            ptr = timed_alloc(w, size);
+            continue;
+        }
+        size += geometric ? size / 2 + 1 : w->opt->size_min;
+        if (size > w->opt->size_max) {
+            timed_free(w, ptr);
+            ptr = NULL;
+            geometric = !geometric;
+            continue;
+        }
+        ptr = timed_realloc(w, ptr, size);
+    }
+    w->live = ptr != NULL ? size : 0;
+    pthread_barrier_wait(w->barrier);
+    if (ptr != NULL)
+        timed_free(w, ptr);
+}
+
+/* Buffer growth: a buffer grows from size_min to size_max by size bytes at a time (-s), as a log
+ * or an output buffer that is appended to, then it is freed. Large buffers show what every growth costs
+ * when the contents are copied: with -m 1048576 -M 67108864 -s 4096 a copy is megabytes long. */
+static void
+workload_grow(struct worker *w)
+{
+    void *ptr = NULL;
+    size_t size = 0;
+
+    for (unsigned long i = 0; i < w->opt->ops; ++i) {
+        if (ptr == NULL) {
+            size = w->opt->size_min;
+            ptr = timed_alloc(w, size);
+            continue;
+        }
+        size += w->opt->size;
+        if (size > w->opt->size_max) {
+            timed_free(w, ptr);
+            ptr = NULL;
+            continue;
+        }
+        ptr = timed_realloc(w, ptr, size);
+    }
+    w->live = ptr != NULL ? size : 0;
+    pthread_barrier_wait(w->barrier);
+    if (ptr != NULL)
+        timed_free(w, ptr);
+}
+
+/* Producer/consumer: even threads allocate objects of random sizes and pass them through a queue
+ * to the next thread, which frees them, so every free is a free of memory of another thread. */
+static void
+workload_prodcons(struct worker *w)
+{
+    struct ring *ring = w->ring;
+    size_t head, tail;
+
+    if (w->producer) {
+        for (unsigned long i = 0; i < w->opt->ops; ++i) {
+            void *ptr = timed_alloc(w, random_size(w));
+
+            tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE)
+                sched_yield();
+            ring->ptrs[tail % RING_SIZE] = ptr;
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+    } else {
+        for (unsigned long i = 0; i < w->opt->ops; ++i) {
+            head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+                sched_yield();
+            timed_free(w, ring->ptrs[head % RING_SIZE]);
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+    }
+    pthread_barrier_wait(w->barrier);
+}
+
+/* Random access: objects of random sizes fill the working set of the thread (-k slots),
+ * then every step updates a word at a random offset of a random object, as a program walking a large heap does. */
+static void
+workload_access(struct worker *w)
+{
+    void **slots;
+    size_t *sizes;
+    size_t idx, offset, n = w->opt->slots;
+
+    slots = calloc(n, sizeof(*slots));
+    sizes = calloc(n, sizeof(*sizes));
+    for (idx = 0; idx < n; ++idx) {
+        sizes[idx] = random_size(w);
+        slots[idx] = timed_alloc(w, sizes[idx]);
+        memset(slots[idx], 0, sizes[idx]);
+        w->live += sizes[idx];
+    }
+    for (unsigned long i = 0; i < w->opt->ops; ++i) {
+        idx = (size_t)rand_r(&w->seed) % n;
+        offset = ((size_t)rand_r(&w->seed) % sizes[idx]) & ~(sizeof(uint64_t) - 1);
+        if (offset + sizeof(uint64_t) <= sizes[idx])
+            ++*(volatile uint64_t *)((char *)slots[idx] + offset);
+    }
+    w->accesses = w->opt->ops;
+    pthread_barrier_wait(w->barrier);
+    for (idx = 0; idx < n; ++idx)
+        timed_free(w, slots[idx]);
+    free(slots);
+    free(sizes);
+}
+
+struct workload {
+    const char *name;
+    void (*run)(struct worker *);
+};
+
+static const struct workload workloads[] = {
+    { "fixed", workload_fixed },
+    { "random", workload_random },
+    { "realloc", workload_realloc },
+    { "grow", workload_grow },
+    { "prodcons", workload_prodcons },
+    { "access", workload_access },
+};
+
+struct run {
+    struct worker *w;
+    const struct workload *wl;
+};
+
+static void *
+worker_main(void *arg)
+{
+    struct run *r = arg;
+
+    r->wl->run(r->w);
+    return NULL;
+}
+
+// Function that returns resident memory of the process in bytes
+static size_t
+rss_bytes(void)
+{
+    unsigned long pages = 0, resident = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lu %lu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Function that resets the peak RSS of the process (Linux 4.0+), it returns false if not supported
+static bool
+rss_peak_reset(void)
+{
+    FILE *f;
+    bool ok;
+
+    f = fopen("/proc/self/clear_refs", "w");
+    if (f == NULL)
+        return false;
+    ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok;
+}
+
+// Function that returns the peak RSS of the process in bytes
+static size_t
+rss_peak_bytes(void)
+{
+    char line[128];
+    size_t kib = 0;
+    struct rusage ru;
+    FILE *f;
+
+    f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL)
+            if (sscanf(line, "VmHWM: %zu kB", &kib) == 1)
+                break;
+        fclose(f);
+    }
+    if (kib == 0 && getrusage(RUSAGE_SELF, &ru) == 0)
+        kib = (size_t)ru.ru_maxrss;
+    return kib * 1024;
+}
+
+// Function that returns the number of minor and major page faults of the process so far
+static void
+page_faults(long *minor, long *major)
+{
+    struct rusage ru;
+
+    *minor = *major = 0;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        *minor = ru.ru_minflt;
+        *major = ru.ru_majflt;
+    }
+}
+
+/* Function that starts counting dTLB load misses of the process and the threads it creates,
+ * it returns -1 if perf events are not available (not Linux, no PMU, perf_event_paranoid) */
+static int
+tlb_counter_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    long fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return (int)fd;
+#else
+    return -1;
+#endif
+}
+
+// Function that returns the dTLB misses counted so far, threads that have exited included
+static uint64_t
+tlb_counter_read(int fd)
+{
+    uint64_t count = 0;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+static void
+bench_run(const struct options *opt, const struct workload *wl, const struct allocator *a, int strategy)
+{
+    unsigned int nthreads = opt->threads, i;
+    pthread_barrier_t barrier;
+    struct worker *workers;
+    struct ring *rings;
+    struct run *runs;
+    pthread_t *threads;
+    struct hist total[OP_NUM];
+    size_t rss_base, rss_end, live = 0;
+    uint64_t t0, elapsed, ops = 0;
+    bool peak_reset;
+    long minflt0, majflt0, minflt, majflt;
+    uint64_t accesses = 0, tlb_misses;
+    int tlb_fd;
+
+    if (wl->run == workload_prodcons && nthreads % 2 != 0)
+        ++nthreads;	// Producers and consumers come in pairs
+    workers = calloc(nthreads, sizeof(*workers));
+    runs = calloc(nthreads, sizeof(*runs));
+    threads = calloc(nthreads, sizeof(*threads));
+    rings = calloc(nthreads, sizeof(*rings));
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].opt = opt;
+        workers[i].a = a;
+        workers[i].barrier = &barrier;
+        workers[i].ring = &rings[i / 2];
+        workers[i].producer = i % 2 == 0;
+        workers[i].seed = i + 1;
+        runs[i].w = &workers[i];
+        runs[i].wl = wl;
+    }
+
+    if (!a->libc) {
+        mem_set_poison(a->poison);
+        mem_set_huge_pages(a->huge);
+        if (strategy >= 0)
+            mem_set_release((enum mem_release)strategy);
+    }
+    rss_base = rss_bytes();
+    page_faults(&minflt0, &majflt0);
+    peak_reset = rss_peak_reset();
+    tlb_fd = tlb_counter_open();
+    t0 = now_ns();
+    for (i = 0; i < nthreads; ++i)
+        pthread_create(&threads[i], NULL, worker_main, &runs[i]);
+    // Workers hold their live objects until everybody is measured
+    pthread_barrier_wait(&barrier);
+    elapsed = now_ns() - t0;
+    rss_end = rss_bytes();
+    page_faults(&minflt, &majflt);
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    // Counts of inherited events are added to the counter when the threads exit
+    tlb_misses = tlb_counter_read(tlb_fd);
+    if (tlb_fd >= 0)
+        close(tlb_fd);
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < nthreads; ++i) {
+        for (int op = 0; op < OP_NUM; ++op) {
+            for (unsigned int b = 0; b < HIST_BUCKETS; ++b)
+                total[op].count[b] += workers[i].hist[op].count[b];
+            total[op].total += workers[i].hist[op].total;
+        }
+        live += workers[i].live;
+        accesses += workers[i].accesses;
+    }
+    for (int op = 0; op < OP_NUM; ++op)
+        ops += total[op].total;
+
+    printf("== %s, %u thread(s), %s%s%s ==\n", wl->name, nthreads, a->name,
+           strategy >= 0 ? ", release " : "", strategy >= 0 ? release_names[strategy] : "");
+    printf("  %-8s %10.2f Mops/s\n", "total", (double)ops / ((double)elapsed / 1e3));
+    for (int op = 0; op < OP_NUM; ++op) {
+        if (total[op].total == 0)
+            continue;
+        printf("  %-8s %10" PRIu64 " ops   p50 %6" PRIu64 " ns   p99 %6" PRIu64 " ns   p999 %7" PRIu64 " ns\n",
+               op_names[op], total[op].total, hist_percentile(&total[op], 0.50),
+               hist_percentile(&total[op], 0.99), hist_percentile(&total[op], 0.999));
+    }
+    printf("  peak RSS %zu KiB%s, live %zu KiB, fragmentation %.2f\n",
+           rss_peak_bytes() / 1024, peak_reset ? "" : " (process)", live / 1024,
+           rss_end > rss_base && live < rss_end - rss_base
+               ? 1.0 - (double)live / (double)(rss_end - rss_base) : 0.0);
+
+    printf("  page faults %ld minor, %ld major\n", minflt - minflt0, majflt - majflt0);
+    if (accesses != 0)
+        printf("  access   %10.2f Mops/s\n", (double)accesses / ((double)elapsed / 1e3));
+    if (tlb_fd >= 0)
+        printf("  dTLB misses %" PRIu64 "\n", tlb_misses);
+
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    free(runs);
+    free(threads);
+    free(rings);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-w fixed|random|realloc|grow|prodcons|access|all] [-n ops] [-t threads]\n"
+            "          [-s size] [-m min] [-M max] [-d uniform|exp] [-k slots] [-l] [-p] [-H]\n"
+            "          [-r dontneed|free|munmap|none|all]\n"
+            "  -w  workload to run (all by default)\n"
+            "  -n  operations per thread (1000000)\n"
+            "  -t  number of threads (1, producer/consumer uses pairs)\n"
+            "  -s  object size of the fixed workload, growth step of the grow workload (64)\n"
+            "  -m  -M  size range of the random, realloc, grow and access workloads (16, 4096)\n"
+            "  -d  size distribution of the random workloads (uniform)\n"
+            "  -k  live objects per thread (1000), the access workload wants a working set\n"
+            "      far beyond the reach of the TLB, e.g. -k 200000 -m 1024 -M 4096\n"
+            "  -l  run every workload against glibc malloc as well\n"
+            "  -p  run every workload against mem_alloc with poisoning of freed memory as well\n"
+            "  -H  run every workload against mem_alloc with arenas backed with huge pages as well\n"
+            "  -r  release strategy of mem_alloc, all runs every workload with each of them\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct options opt = {
+        .workload = "all", .ops = 1000000, .threads = 1, .size = 64,
+        .size_min = 16, .size_max = 4096, .exp_sizes = false, .slots = 1000, .libc = false,
+        .poison = false, .huge = false, .release = -1,
+    };
+    size_t i, j;
+    int c, k;
+
+    while ((c = getopt(argc, argv, "w:n:t:s:m:M:d:k:lpHr:")) != -1) {
+        switch (c) {
+        case 'w': opt.workload = optarg; break;
+        case 'n': opt.ops = strtoul(optarg, NULL, 0); break;
+        case 't': opt.threads = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 's': opt.size = strtoul(optarg, NULL, 0); break;
+        case 'm': opt.size_min = strtoul(optarg, NULL, 0); break;
+        case 'M': opt.size_max = strtoul(optarg, NULL, 0); break;
+        case 'd': opt.exp_sizes = strcmp(optarg, "exp") == 0; break;
+        case 'k': opt.slots = strtoul(optarg, NULL, 0); break;
+        case 'l': opt.libc = true; break;
+        case 'p': opt.poison = true; break;
+        case 'H': opt.huge = true; break;
+        case 'r':
+            opt.release = RELEASE_ALL;
+            for (j = 0; j < RELEASE_ALL; ++j)
+                if (strcmp(optarg, release_names[j]) == 0)
+                    opt.release = (int)j;
+            if (opt.release == RELEASE_ALL && strcmp(optarg, "all") != 0)
+                usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (opt.threads == 0 || opt.slots == 0 || opt.size_min == 0 || opt.size_min > opt.size_max)
+        usage(argv[0]);
+
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        if (strcmp(opt.workload, "all") != 0 && strcmp(opt.workload, workloads[i].name) != 0)
+            continue;
+        for (j = 0; j < sizeof(allocators) / sizeof(allocators[0]); ++j) {
+            if ((allocators[j].libc && !opt.libc) || (allocators[j].poison && !opt.poison)
+                    || (allocators[j].huge && !opt.huge))
+                continue;
+            if (allocators[j].libc || opt.release != RELEASE_ALL) {
+                bench_run(&opt, &workloads[i], &allocators[j], allocators[j].libc ? -1 : opt.release);
+                continue;
+            }
+            for (k = 0; k < RELEASE_ALL; ++k)
+                bench_run(&opt, &workloads[i], &allocators[j], k);
+        }
+    }
+    return 0;
+}
@@ -1,10 +1,12 @@
 #include <assert.h>
+#include <stdint.h>
 
 #include "block.h"
 #include "config.h"
 #include "kernel.h"
 
-/* Function block_split() splits a memory block into two blocks. The original block is marked as busy.
+/* Function block_split() splits a memory block into two blocks. The original block is marked as busy
+ * and the new block is free, boundary tags of both are updated.
  * If there is not enough space in the original block to accommodate a new block of the specified size,
  * then a new block is created from the remaining space.
  * The function takes pointer to the block that needs to be split and size of memory to allocate from the block
@@ -32,26 +34,32 @@ Block* block_split(Block *block, size_t size) {
 
 	// Create new block from the remaining space
         block_r = block_next(block);
-        block_init(block_r);
+        block_init(block_r, block_get_heap(block));
         block_set_size_curr(block_r, size_rest);
-        block_set_size_prev(block_r, size);
+        if (block_get_flag_clean(block)) {
+            block_set_flag_clean(block_r);	// Only the header of the new block has been written
+        }
+        if (block_get_flag_huge(block)) {
+            block_set_flag_huge(block_r);
+        }
 
-	// Update flags and size of adjacent blocks
-        block_set_offset(block_r, block_get_offset(block) + size + BLOCK_STRUCT_SIZE);
+	// Update flags and boundary tags of adjacent blocks
         if (block_get_flag_last(block)) {
             block_clr_flag_last(block);
             block_set_flag_last(block_r);
-        } else {
-            block_set_size_prev(block_next(block_r), size_rest);
         }
+        block_update_tag(block);
+        block_update_tag(block_r);
         return block_r;	// Return pointer to the new block
     }
+    block_update_tag(block);
     return NULL;	// Return NULL if there's not enough space to create a new block
 }
 
 
 /* Function block_merge() merges two adjacent blocks into a single block.
- * It takes pointer to the first block and pointer to the adjacent block as parameters. */
+ * It takes pointer to the first block and pointer to the adjacent block as parameters.
+ * The first block may be busy (when a block grows in place) or free. */
 void
 block_merge(Block *block, Block *block_r) {
     assert(block_get_flag_busy(block_r) == false);	// Make sure that the second block is not busy
@@ -59,6 +67,10 @@ block_merge(Block *block, Block *block_r) {
 
     size_t size;
 
+    /* The merged block is not clean: free blocks are merged as soon as they meet,
+     * so one of the two blocks is busy or has just been freed and holds data of the program */
+    block_clr_flag_clean(block);
+
     // Calculate the size of merged block
     size = block_get_size_curr(block) + block_get_size_curr(block_r) + BLOCK_STRUCT_SIZE;
     
@@ -68,48 +80,49 @@ block_merge(Block *block, Block *block_r) {
     if (block_get_flag_last(block_r)) {
         block_set_flag_last(block);
     }
-    else {
-        block_set_size_prev(block_next(block_r), size);
-    }
+    block_update_tag(block);
 
 }
 
 #include <stdio.h>
 
 
-/* Function block_dontneed resets memory regions that are no longer needed to a specific pattern.
+/* Function block_dontneed gives the pages of a free block back to the kernel.
  * It's used for optimizing usage and reclaiming unused memory pages.
- * It takes pointer to the block whose memory regions are about to be reset as parameters. */
-void block_dontneed(Block* block) {
-    size_t size_curr;
-    size_t offset, offset1, offset2;
-
-    // Get current size of the block
-    size_curr = block_get_size_curr(block);
-
-    // Check if the size of the block is less than a page size
-    if (size_curr - sizeof(tree_node_type) < ALLOCATOR_PAGE_SIZE) {
-        return;	// Return uf the block size is less than a page size
+ * Released pages read back as zeros if the kernel guarantees it, then the block is marked clean;
+ * a block that is clean already has nothing to release.
+ * In an arena backed with huge pages only whole huge pages are released, see block_trim_range(),
+ * the block stays dirty then unless they cover all of its clean range.
+ * Lazily released pages (MADV_FREE) are taken by the kernel only when it needs memory, their contents are undefined.
+ * It takes pointer to the block whose memory regions are about to be reset and the way to release them as parameters. */
+void block_dontneed(Block* block, bool lazy) {
+    uintptr_t offset1, offset2, start, end;
+
+    if (block_get_flag_clean(block)) {
+        return;
     }
 
-    // Calculate offsets for resetting memory regions
-    offset = block_get_offset(block);
-
-    offset1 = offset + BLOCK_STRUCT_SIZE + sizeof(tree_node_type);
-    offset1 = (offset1 + ALLOCATOR_PAGE_SIZE - 1) & ~((size_t)ALLOCATOR_PAGE_SIZE - 1);
-
-    offset2 = offset + size_curr + BLOCK_STRUCT_SIZE;
-    offset2 &= ~((size_t)ALLOCATOR_PAGE_SIZE - 1);
-
+    // Calculate addresses for resetting memory regions, the tree node and the footer must survive
+    block_clean_range(block, &offset1, &offset2);
 
     // Check if the block spans across multiple memory pages
-    if (offset1 == offset2) {
-        return;	// Returb is the block spans actoss only one memory page
+    if (offset1 >= offset2) {
+        block_set_flag_clean(block);	// There is no whole page in the block, so it is clean by definition
+        return;
     }
 
     // Assert that the difference between two offsets is a multiple of the page size
-    assert(((offset2 - offset1) & ((size_t)ALLOCATOR_PAGE_SIZE - 1)) == 0);
+    assert(((offset2 - offset1) & ((uintptr_t)kernel_page_size() - 1)) == 0);
 
-    // Reset memory regions to a specific pattern
-    kernel_reset((char*)block + (offset1 - offset), offset2 - offset1);
+    // Keep the huge pages the block shares with its neighbours or the tree node intact
+    block_trim_range(block, &start, &end);
+    if (start >= end) {
+        return;
+    }
+
+    // Release the pages, their contents are lost
+    if ((lazy ? kernel_reset_lazy((void*)start, end - start) : kernel_reset((void*)start, end - start))
+            && start == offset1 && end == offset2) {
+        block_set_flag_clean(block);
+    }
 }
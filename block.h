@@ -1,24 +1,84 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "allocator_impl.h"
+#include "config.h"
+#include "kernel.h"
 #include "tree.h"
 
 #define BLOCK_OCCUPIED (size_t)0x1
 #define BLOCK_LAST (size_t)0x2
+#define BLOCK_PREV_FREE (size_t)0x4	// The previous block is free and its size is in its footer
+#define BLOCK_FIRST (size_t)0x8
+
+/* The index of the heap owning the block is packed into the top bits of the header.
+ * Block sizes never reach these bits or the flags below them, see BLOCK_SIZE_MAX. */
+#define BLOCK_HEAP_SHIFT 48
+#define BLOCK_HEAP_MASK (~(size_t)0 << BLOCK_HEAP_SHIFT)
+
+/* Every whole page of the block outside its tree node and footer is known to be zero,
+ * see block_clean_range(). Kept in the highest bit below the heap index. */
+#define BLOCK_CLEAN ((size_t)1 << (BLOCK_HEAP_SHIFT - 1))
+
+// The free block is on the list of blocks of its heap whose pages have not been given back to the kernel yet
+#define BLOCK_DIRTY ((size_t)1 << (BLOCK_HEAP_SHIFT - 2))
+
+/* The block has a mapping of its own instead of being part of an arena. Arenas differ in size,
+ * so the size of a block alone does not tell if it has been allocated directly from the kernel. */
+#define BLOCK_MAPPED ((size_t)1 << (BLOCK_HEAP_SHIFT - 3))
+
+// The block is part of an arena backed with huge pages
+#define BLOCK_HUGE ((size_t)1 << (BLOCK_HEAP_SHIFT - 4))
+
+// The block keeps its 'busy' flag but waits in a small bin of its heap to be reused
+#define BLOCK_BINNED ((size_t)1 << (BLOCK_HEAP_SHIFT - 5))
+
+// The heap profiler keeps the call stack of the busy block, see prof.c
+#define BLOCK_SAMPLED ((size_t)1 << (BLOCK_HEAP_SHIFT - 6))
+
+#define BLOCK_FLAGS_HIGH (BLOCK_CLEAN | BLOCK_DIRTY | BLOCK_MAPPED | BLOCK_HUGE | BLOCK_BINNED | BLOCK_SAMPLED)
+#define BLOCK_FLAGS (BLOCK_OCCUPIED | BLOCK_LAST | BLOCK_PREV_FREE | BLOCK_FIRST | BLOCK_FLAGS_HIGH)
+
+/* The size of a block with its header shares the header with the flags above, so it must stay below
+ * the lowest of the high flags, BLOCK_SIZE_LIMIT (4 TiB). Requests larger than BLOCK_SIZE_MAX fail:
+ * the other half of the limit leaves room for rounding a block up to whole (huge) pages of its mapping. */
+#define BLOCK_SIZE_LIMIT (BLOCK_FLAGS_HIGH & ~(BLOCK_FLAGS_HIGH - 1))
+#define BLOCK_SIZE_MAX (BLOCK_SIZE_LIMIT / 2)
+
+_Static_assert(((BLOCK_SIZE_LIMIT - 1) & (BLOCK_FLAGS_HIGH | BLOCK_HEAP_MASK)) == 0,
+               "Block sizes overlap the high flags of the header");
+_Static_assert(BLOCK_SIZE_LIMIT - BLOCK_SIZE_MAX > 2 * (size_t)ALLOCATOR_HUGE_PAGE_SIZE,
+               "No room to round the largest block up to whole pages");
 
 /* Structure that represent a memory block used by the memory allocator
+ * The header is a single word: size of the block together with its header
+ * (a multiple of ALIGN, so the low bits are free for flags) and the index of the heap.
+ * Busy blocks do not keep the size of the previous block. Only a free block writes its size
+ * into a footer, the last word of its payload, and the next block gets the BLOCK_PREV_FREE flag.
+ * Blocks start ARENA_BLOCK_OFFSET bytes into the arena, so their payloads stay ALIGN aligned.
+ * The header is written under the lock of the heap (or while no other thread can reach the block),
+ * but the thread owning a busy block reads it without the lock while a neighbour that is freed
+ * changes its BLOCK_PREV_FREE flag. So it is only accessed atomically, with relaxed loads and stores
+ * that cost no more than plain ones, see block_load() and block_store().
  */
 typedef struct {
-    size_t size_curr;	// Size of the block
-    size_t size_prev;	// Size of the previous block
-    size_t offset;	// Offset of the block from the start of the arena
+    _Atomic size_t size_curr;	// Size of the block with its header, flags and index of the heap owning the arena
     //bool flag_busy;
     //bool flag_first;
     //bool flag_last;
 } Block;
 
-#define BLOCK_STRUCT_SIZE ROUND_BYTES(sizeof(Block))
-#define BLOCK_SIZE_MIN ROUND_BYTES(sizeof(tree_node_type))
+#define BLOCK_STRUCT_SIZE sizeof(Block)
+// Block sizes are such that the size together with the header is a multiple of ALIGN
+#define BLOCK_SIZE_ROUND(x) (ROUND_BYTES((x) + BLOCK_STRUCT_SIZE) - BLOCK_STRUCT_SIZE)
+// A free block holds a tree node and its footer
+#define BLOCK_SIZE_MIN BLOCK_SIZE_ROUND(sizeof(tree_node_type) + sizeof(size_t))
+
+// Offset of the first block from the start of the (page aligned) arena
+#define ARENA_BLOCK_OFFSET (ALIGN - BLOCK_STRUCT_SIZE)
+// Number of bytes of an arena that are not part of the size of its first block
+#define ARENA_OVERHEAD (ALIGN + ARENA_BLOCK_OFFSET)
 
 // Function that splits memory block into two blocks
 Block *block_split(Block *, size_t);
@@ -26,8 +86,8 @@ Block *block_split(Block *, size_t);
 // Function that merges two adjacent memory blocks
 void block_merge(Block *, Block *);
 
-// Function that unmaps pages that are not required within a memory block
-void block_dontneed(Block *);
+// Function that gives pages of a free block back to the kernel, at once or lazily
+void block_dontneed(Block *, bool);
 
 
 // Function that converts a block pointerrrr to a payload pointer
@@ -44,6 +104,13 @@ payload_to_block(const void *ptr)
     return (Block *)((char *)ptr - BLOCK_STRUCT_SIZE);
 }
 
+// Function that returns a pointer to the link of a busy block chained through its payload
+static inline Block **
+block_link(const Block *block)
+{
+    return block_to_payload(block);
+}
+
 // Function that converts a block pointer to a tree node pointer
 static inline tree_node_type *
 block_to_node(const Block *block)
@@ -58,61 +125,195 @@ node_to_block(const tree_node_type *node)
     return payload_to_block(node);
 }
 
+// Function that reads the header word of the block
+static inline size_t
+block_load(const Block *block)
+{
+    return atomic_load_explicit(&block->size_curr, memory_order_relaxed);
+}
+
+// Function that writes the header word of the block, writers are serialized by the lock of the heap
+static inline void
+block_store(Block *block, size_t word)
+{
+    atomic_store_explicit(&block->size_curr, word, memory_order_relaxed);
+}
+
 // Function that sets the current size of the block
 static inline void
 block_set_size_curr(Block *block, size_t size)
 {
-    size_t flags = block->size_curr & (BLOCK_OCCUPIED | BLOCK_LAST);
-    block->size_curr = size | flags;
+    size_t flags = block_load(block) & (BLOCK_FLAGS | BLOCK_HEAP_MASK);
+    block_store(block, (size + BLOCK_STRUCT_SIZE) | flags);
 }
 
 // Function that returns current size of the block
 static inline size_t
 block_get_size_curr(const Block *block)
 {
-    return block->size_curr & ~(BLOCK_OCCUPIED | BLOCK_LAST);
+    return (block_load(block) & ~(BLOCK_FLAGS | BLOCK_HEAP_MASK)) - BLOCK_STRUCT_SIZE;
 }
 
-// Function that sets the previous size of the block
-static inline void
-block_set_size_prev(Block *block, size_t size)
+// Function that returns a pointer to the footer of the block, the last word of its payload
+static inline size_t *
+block_footer(const Block *block)
 {
-    block->size_prev = size;
+    return (size_t *)((char *)block + block_get_size_curr(block));
 }
 
-// Function that returns the previous size of the block
+// Function that returns the previous size of the block, it is known only if the previous block is free
 static inline size_t
 block_get_size_prev(const Block *block)
 {
-    return block->size_prev;
+    return ((const size_t *)block)[-1];
 }
 
 // Function that sets flag 'busy' for the block
 static inline void
 block_set_flag_busy(Block *block)
 {
-    block->size_curr |= BLOCK_OCCUPIED;
+    block_store(block, block_load(block) | BLOCK_OCCUPIED);
 }
 
 // Function that checks if the block is busy
 static inline bool
 block_get_flag_busy(const Block *block)
 {
-    return (block->size_curr & BLOCK_OCCUPIED) != 0;
+    return (block_load(block) & BLOCK_OCCUPIED) != 0;
 }
 
 // Function that clears the 'busy' flag for the block
 static inline void
 block_clr_flag_busy(Block *block)
 {
-    block->size_curr &= ~(BLOCK_OCCUPIED);
+    block_store(block, block_load(block) & ~BLOCK_OCCUPIED);
+}
+
+// Function that sets flag 'clean' for the block
+static inline void
+block_set_flag_clean(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_CLEAN);
+}
+
+/* Function that checks if the block is clean. The flag is kept up to date for free blocks
+ * and blocks just taken from the tree or the kernel, blocks given to the program may have a stale one. */
+static inline bool
+block_get_flag_clean(const Block *block)
+{
+    return (block_load(block) & BLOCK_CLEAN) != 0;
+}
+
+// Function that clears the 'clean' flag for the block
+static inline void
+block_clr_flag_clean(Block *block)
+{
+    block_store(block, block_load(block) & ~BLOCK_CLEAN);
+}
+
+// Function that sets flag 'dirty' for the block
+static inline void
+block_set_flag_dirty(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_DIRTY);
+}
+
+// Function that checks if the block is on the dirty list of its heap
+static inline bool
+block_get_flag_dirty(const Block *block)
+{
+    return (block_load(block) & BLOCK_DIRTY) != 0;
+}
+
+// Function that clears the 'dirty' flag for the block
+static inline void
+block_clr_flag_dirty(Block *block)
+{
+    block_store(block, block_load(block) & ~BLOCK_DIRTY);
+}
+
+// Function that sets flag 'mapped' for the block
+static inline void
+block_set_flag_mapped(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_MAPPED);
+}
+
+// Function that checks if the block has been allocated directly from the kernel
+static inline bool
+block_get_flag_mapped(const Block *block)
+{
+    return (block_load(block) & BLOCK_MAPPED) != 0;
+}
+
+// Function that sets flag 'huge' for the block
+static inline void
+block_set_flag_huge(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_HUGE);
+}
+
+// Function that checks if the block is part of an arena backed with huge pages
+static inline bool
+block_get_flag_huge(const Block *block)
+{
+    return (block_load(block) & BLOCK_HUGE) != 0;
+}
+
+// Function that sets flag 'binned' for the block
+static inline void
+block_set_flag_binned(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_BINNED);
+}
+
+// Function that checks if the block is in a small bin of its heap
+static inline bool
+block_get_flag_binned(const Block *block)
+{
+    return (block_load(block) & BLOCK_BINNED) != 0;
+}
+
+// Function that clears the 'binned' flag for the block
+static inline void
+block_clr_flag_binned(Block *block)
+{
+    block_store(block, block_load(block) & ~BLOCK_BINNED);
+}
+
+// Function that sets flag 'sampled' for the block
+static inline void
+block_set_flag_sampled(Block *block)
+{
+    block_store(block, block_load(block) | BLOCK_SAMPLED);
+}
+
+// Function that checks if the heap profiler keeps a sample of the block
+static inline bool
+block_get_flag_sampled(const Block *block)
+{
+    return (block_load(block) & BLOCK_SAMPLED) != 0;
+}
+
+// Function that clears the 'sampled' flag for the block
+static inline void
+block_clr_flag_sampled(Block *block)
+{
+    block_store(block, block_load(block) & ~BLOCK_SAMPLED);
 }
 
 // Function that checks if the block is the first one in arena
 static inline bool
 block_get_flag_first(const Block *block)
 {
-    return (block->size_prev == 0) ? true : false;
+    return (block_load(block) & BLOCK_FIRST) != 0;
+}
+
+// Function that checks if the previous block is free
+static inline bool
+block_get_flag_prev_free(const Block *block)
+{
+    return (block_load(block) & BLOCK_PREV_FREE) != 0;
 }
 
 
@@ -120,31 +321,26 @@ block_get_flag_first(const Block *block)
 static inline void
 block_set_flag_last(Block *block)
 {
-    block->size_curr |= BLOCK_LAST;
+    block_store(block, block_load(block) | BLOCK_LAST);
 }
 
 // Function that checks if the block is the last one in arena
 static inline bool
 block_get_flag_last(const Block *block)
 {
-    return (block->size_curr & BLOCK_LAST) != 0;
+    return (block_load(block) & BLOCK_LAST) != 0;
 }
 
 // Function that clears the 'last' flag for the block
 static inline void
 block_clr_flag_last(Block *block)
 {
-    block->size_curr &= ~(BLOCK_LAST);
-}
-
-// Function that sets the offset of the block
-static inline void block_set_offset(Block* block, size_t offset) {
-    block->offset = offset;
+    block_store(block, block_load(block) & ~BLOCK_LAST);
 }
 
-// Function that returns the offset of tje block
-static inline size_t block_get_offset(Block* block) {
-    return block->offset;
+// Function that returns the index of the heap owning the block
+static inline unsigned int block_get_heap(const Block* block) {
+    return (unsigned int)(block_load(block) >> BLOCK_HEAP_SHIFT);
 }
 
 // Function that returns a pointer to the next block in the arena
@@ -155,7 +351,7 @@ block_next(const Block *block)
         ((char *)block + BLOCK_STRUCT_SIZE + block_get_size_curr(block));
 }
 
-// Function that returns a pointer to the previous blovk in arena
+// Function that returns a pointer to the previous blovk in arena, the previous block must be free
 static inline Block *
 block_prev(const Block *block)
 {
@@ -163,19 +359,98 @@ block_prev(const Block *block)
         ((char *)block - BLOCK_STRUCT_SIZE - block_get_size_prev(block));
 }
 
-// Function that initializes the block by clearing the flags
+/* Function that brings the boundary tag of the block in line with its 'busy' flag:
+ * a free block writes its footer and the next block learns whether its previous block is free.
+ * That is the one write into the header of another block, the flag is changed with an atomic operation
+ * while the thread owning the next block may be reading its header. */
 static inline void
-arena_init(Block *block, size_t size)
+block_update_tag(Block *block)
 {
-    block->size_curr = size;
-    block->size_prev = 0;
-    block->offset = 0;
-    block_set_flag_last(block);
+    Block *block_n;
+
+    if (!block_get_flag_busy(block)) {
+        *block_footer(block) = block_get_size_curr(block);
+    }
+    if (!block_get_flag_last(block)) {
+        block_n = block_next(block);
+        if (block_get_flag_busy(block)) {
+            atomic_fetch_and_explicit(&block_n->size_curr, ~BLOCK_PREV_FREE, memory_order_relaxed);
+        } else {
+            atomic_fetch_or_explicit(&block_n->size_curr, BLOCK_PREV_FREE, memory_order_relaxed);
+        }
+    }
+}
+
+// Function that returns the first block of an arena
+static inline Block *
+arena_to_block(void *arena)
+{
+    return (Block *)((char *)arena + ARENA_BLOCK_OFFSET);
+}
+
+// Function that returns the arena of its first block
+static inline void *
+block_to_arena(const Block *block)
+{
+    return (char *)block - ARENA_BLOCK_OFFSET;
+}
+
+/* A block allocated directly from the kernel may start further into its mapping than ARENA_BLOCK_OFFSET
+ * to align its payload. The distance is kept in the word in front of the block: a first block
+ * has no previous block whose footer could be there. Arenas of a heap use that word to link each other. */
+static inline size_t
+arena_get_gap(const Block *block)
+{
+    return ((const size_t *)block)[-1];
+}
+
+// Function that records how much further into its mapping the first block starts
+static inline void
+arena_set_gap(Block *block, size_t gap)
+{
+    ((size_t *)block)[-1] = gap;
+}
+
+/* Function that returns the range of whole pages of the block that a 'clean' flag refers to:
+ * pages between the tree node at the start of the payload and the footer at its end.
+ * The range is empty (start >= end) for blocks smaller than about two pages. */
+static inline void
+block_clean_range(const Block *block, uintptr_t *start, uintptr_t *end)
+{
+    uintptr_t page_size = kernel_page_size();
+
+    *start = ROUND((uintptr_t)block + BLOCK_STRUCT_SIZE + sizeof(tree_node_type), page_size);
+    *end = ((uintptr_t)block + BLOCK_STRUCT_SIZE + block_get_size_curr(block) - sizeof(size_t)) & ~(page_size - 1);
+}
+
+/* Function that returns the range of pages of the block that are given back to the kernel:
+ * the range of block_clean_range() shrunk to whole huge pages if the arena is backed with them,
+ * giving back a part of a huge page would make the kernel split it into normal pages. */
+static inline void
+block_trim_range(const Block *block, uintptr_t *start, uintptr_t *end)
+{
+    block_clean_range(block, start, end);
+    if (block_get_flag_huge(block)) {
+        *start = ROUND(*start, (uintptr_t)ALLOCATOR_HUGE_PAGE_SIZE);
+        *end &= ~((uintptr_t)ALLOCATOR_HUGE_PAGE_SIZE - 1);
+    }
+}
+
+// Function that initializes the only block of an arena of the given size and returns it
+static inline Block *
+arena_init(void *arena, size_t size, unsigned int heap)
+{
+    Block *block = arena_to_block(arena);
+
+    // Memory of a new arena comes from the kernel filled with zeros
+    block_store(block, (size_t)heap << BLOCK_HEAP_SHIFT | BLOCK_FIRST | BLOCK_LAST | BLOCK_CLEAN);
+    block_set_size_curr(block, size - ARENA_OVERHEAD);
+    return block;
 }
 
+// Function that initializes a new block of the heap by clearing the flags
 static inline void
-block_init(Block *block)
+block_init(Block *block, unsigned int heap)
 {
-    block_clr_flag_busy(block);
-    block_clr_flag_last(block);
+    block_store(block, (size_t)heap << BLOCK_HEAP_SHIFT);
 }
@@ -1,2 +1,105 @@
-#define ALLOCATOR_PAGE_SIZE 4096
+/* Sizes below that are given in pages are multiples of the page size of the kernel, kernel_page_size(),
+ * which is found out at run time. So the same build works with 4 KiB, 16 KiB and 64 KiB pages. */
+
+/* Arenas of a heap grow geometrically: the first one has ALLOCATOR_ARENA_PAGES pages and every next one
+ * is twice as large, up to ALLOCATOR_ARENA_SIZE_MAX bytes. So a small process maps little memory
+ * and a large heap needs few mappings. Once arenas of a heap are freed, its next arena is sized
+ * by the number of arenas it has left, so a heap that has shrunk maps small arenas again.
+ * Requests that do not fit into an arena of the current size of the heap are allocated directly
+ * from the kernel. mem_set_arena_size() changes both limits at run time. */
+#ifndef ALLOCATOR_ARENA_PAGES
 #define ALLOCATOR_ARENA_PAGES 16
+#endif
+#ifndef ALLOCATOR_ARENA_SIZE_MAX
+#define ALLOCATOR_ARENA_SIZE_MAX (16 * 1024 * 1024)
+#endif
+
+/* Arenas may be backed with transparent huge pages of ALLOCATOR_HUGE_PAGE_SIZE bytes, so a large heap
+ * takes far fewer TLB entries. Such arenas are aligned to and sized in whole huge pages, and pages of their
+ * free blocks are given back to the kernel only in whole huge pages, so trimming never splits a huge page.
+ * Off unless the allocator is built with -DALLOCATOR_HUGE_PAGES=1, the MEM_HUGE_PAGES environment variable
+ * is set to 1 or mem_set_huge_pages() turns it on. */
+#ifndef ALLOCATOR_HUGE_PAGES
+#define ALLOCATOR_HUGE_PAGES 0
+#endif
+#define ALLOCATOR_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Thread-safe mode: blocks_tree is protected by a lock and every thread keeps
+ * a cache of recently freed small blocks in front of it.
+ * Build with -DALLOCATOR_THREADS=0 for the single-threaded allocator. */
+#ifndef ALLOCATOR_THREADS
+#define ALLOCATOR_THREADS 1
+#endif
+
+/* Number of heaps (sets of arenas with their own tree and lock) threads are bound to round-robin,
+ * so threads bound to different heaps never split or merge the same blocks. */
+#ifndef ALLOCATOR_HEAPS
+#if ALLOCATOR_THREADS
+#define ALLOCATOR_HEAPS 8
+#else
+#define ALLOCATOR_HEAPS 1
+#endif
+#endif
+
+/* Small sizes (up to ALLOCATOR_SMALL_SIZE_MAX bytes) are served from segregated free lists of every heap.
+ * An empty list is refilled with a slab of ALLOCATOR_SMALL_SLAB_SIZE bytes carved from an arena,
+ * and a list keeps at most ALLOCATOR_SMALL_BIN_COUNT freed blocks before they go back to the tree. */
+#define ALLOCATOR_SMALL_SIZE_MAX 512
+#define ALLOCATOR_SMALL_SLAB_SIZE 4096
+#define ALLOCATOR_SMALL_BIN_COUNT 64
+
+/* Pages of free blocks are given back to the kernel lazily. A heap lets up to ALLOCATOR_TRIM_THRESHOLD_PAGES pages
+ * of free blocks stay resident, beyond that its oldest dirty pages are released until half of the threshold is left.
+ * Pages that stayed unused for ALLOCATOR_TRIM_DECAY_MS milliseconds are released as well,
+ * the next time the heap frees a block. mem_trim() releases everything at once. */
+#ifndef ALLOCATOR_TRIM_THRESHOLD_PAGES
+#define ALLOCATOR_TRIM_THRESHOLD_PAGES 256
+#endif
+#ifndef ALLOCATOR_TRIM_DECAY_MS
+#define ALLOCATOR_TRIM_DECAY_MS 1000
+#endif
+
+/* Arenas that become empty are kept in a cache of up to ALLOCATOR_ARENA_CACHE_COUNT arenas and
+ * ALLOCATOR_ARENA_CACHE_BYTES bytes instead of being unmapped at once, so a heap that oscillates around
+ * an arena boundary does not map and unmap an arena on every cycle. A cached arena that is not reused
+ * for ALLOCATOR_ARENA_CACHE_DECAY_MS milliseconds is unmapped. */
+#ifndef ALLOCATOR_ARENA_CACHE_COUNT
+#define ALLOCATOR_ARENA_CACHE_COUNT 8
+#endif
+#ifndef ALLOCATOR_ARENA_CACHE_BYTES
+#define ALLOCATOR_ARENA_CACHE_BYTES (8 * 1024 * 1024)
+#endif
+#ifndef ALLOCATOR_ARENA_CACHE_DECAY_MS
+#define ALLOCATOR_ARENA_CACHE_DECAY_MS 1000
+#endif
+
+/* Freed memory is filled with ALLOCATOR_POISON_BYTE, so a use after free reads garbage instead of the old data.
+ * Poisoning costs a pass over every freed block, it is off unless the allocator is built with
+ * -DALLOCATOR_POISON=1 (the debug-checked library is) or mem_set_poison() turns it on at run time. */
+#ifndef ALLOCATOR_POISON
+#define ALLOCATOR_POISON 0
+#endif
+#define ALLOCATOR_POISON_BYTE 0x7e
+
+/* Traced calls are kept in a ring buffer of ALLOCATOR_TRACE_RING records (a power of two) per thread,
+ * a background thread writes them out every ALLOCATOR_TRACE_FLUSH_MS milliseconds. */
+#ifndef ALLOCATOR_TRACE_RING
+#define ALLOCATOR_TRACE_RING 16384
+#endif
+#ifndef ALLOCATOR_TRACE_FLUSH_MS
+#define ALLOCATOR_TRACE_FLUSH_MS 1
+#endif
+
+/* The heap profiler samples an allocation every ALLOCATOR_PROF_INTERVAL bytes allocated on average
+ * and keeps up to ALLOCATOR_PROF_DEPTH return addresses of its call stack. */
+#ifndef ALLOCATOR_PROF_INTERVAL
+#define ALLOCATOR_PROF_INTERVAL (512 * 1024)
+#endif
+#ifndef ALLOCATOR_PROF_DEPTH
+#define ALLOCATOR_PROF_DEPTH 32
+#endif
+
+// Largest block size (in bytes) that is kept in a thread cache
+#define ALLOCATOR_TCACHE_SIZE_MAX 512
+// Number of blocks of one size a thread cache keeps before it returns half of them
+#define ALLOCATOR_TCACHE_COUNT 32
@@ -1,12 +1,11 @@
+#define _GNU_SOURCE	// mremap()
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 #include <unistd.h>
 
 #include "kernel.h"
 
-#define DEBUG_KERNEL_RESET
-
 /* If the kernel_alloc function fails, than the failed_kernel_alloc function will be triggered.
  * The function will print an error message in stderr (standard error - one of the standard streams)
  * and terminate the program with an error code. */
@@ -51,6 +50,13 @@ failed_kernel_reset(void) {
 
 #include <sys/mman.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <stdatomic.h>
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
 
 /* kernel_alloc() function allocates memory for the kernel.
  * It uses mmap() system call to obrain anonymous memory that has no file origin.
@@ -79,6 +85,49 @@ kernel_alloc(size_t size)
     return ptr;
 }
 
+/* kernel_alloc_aligned() function allocates memory for the kernel, so that the address offset bytes
+ * into the memory is aligned to alignment. Both alignment (a power of two) and offset are multiples of the page size.
+ * It maps alignment bytes more than requested and unmaps the unaligned head and the unused tail,
+ * the result is released with kernel_free() like any other memory. It returns NULL if there is not enough memory. */
+
+void *
+kernel_alloc_aligned(size_t size, size_t alignment, size_t offset)
+{
+    char *ptr, *ptr_aligned;
+    size_t head;
+
+    if (size > SIZE_MAX - alignment)
+        return NULL;
+    ptr = kernel_alloc(size + alignment);
+    if (ptr == NULL)
+        return NULL;
+    ptr_aligned = (char *)((((uintptr_t)ptr + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - offset);
+    head = (size_t)(ptr_aligned - ptr);
+    if (head != 0)
+        kernel_free(ptr, head);
+    if (alignment - head != 0)
+        kernel_free(ptr_aligned + size, alignment - head);
+    return ptr_aligned;
+}
+
+/* kernel_alloc_huge() function allocates memory for the kernel aligned to the huge page size
+ * and asks the kernel to back it with transparent huge pages (MADV_HUGEPAGE), so every huge page
+ * of the memory takes a single TLB entry. The advice is ignored if the kernel has no transparent huge pages,
+ * the memory is still usable with normal pages then. It returns NULL if there is not enough memory. */
+
+void *
+kernel_alloc_huge(size_t size, size_t huge_page_size)
+{
+    void *ptr;
+
+    ptr = kernel_alloc_aligned(size, huge_page_size, 0);
+#ifdef MADV_HUGEPAGE
+    if (ptr != NULL)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
 /* kernel_free() function releases memory previously allocated by kernel_alloc().
  * To do that it uses munmap() system call. */
 
@@ -88,22 +137,167 @@ kernel_free(void *ptr, size_t size){
         failed_kernel_free();
 } 
 
+/* kernel_realloc() function changes the size of memory previously allocated by kernel_alloc() without copying it.
+ * Both sizes are multiples of the page size. On Linux it uses mremap() system call, which moves the pages
+ * to another address if the memory cannot grow where it is. Elsewhere memory only shrinks,
+ * the tail is unmapped. It returns the address of the memory, or NULL if its size could not be changed;
+ * the memory is left as it was then. */
+
+void *
+kernel_realloc(void *ptr, size_t size_old, size_t size_new)
+{
+#ifdef MREMAP_MAYMOVE
+    ptr = mremap(ptr, size_old, size_new, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED) {
+        if (errno == ENOMEM)
+            return NULL;
+        failed_kernel_alloc();
+    }
+    return ptr;
+#else
+    if (size_new > size_old)
+        return NULL;
+    if (size_new < size_old)
+        kernel_free((char *)ptr + size_new, size_old - size_new);
+    return ptr;
+#endif
+}
+
+/* kernel_page_size() function returns the size of a page of the kernel, the unit of mmap() and madvise().
+ * It asks sysconf() once and remembers the answer. */
+
+size_t
+kernel_page_size(void)
+{
+    static atomic_size_t page_size;
+    size_t size;
+    long value;
+
+    size = atomic_load_explicit(&page_size, memory_order_relaxed);
+    if (size == 0) {
+        value = sysconf(_SC_PAGESIZE);
+        size = value > 0 ? (size_t)value : 4096;
+        atomic_store_explicit(&page_size, size, memory_order_relaxed);
+    }
+    return size;
+}
+
 /* kernel_reset() function resets the values of memory previously allocated by kernel_alloc().
  * To do that it uses madvice() system call for pre-fetching memory.
- * If the madvice() call fails, it calls the failed_kernel_reset() function. */
+ * If the madvice() call fails, it calls the failed_kernel_reset() function.
+ * The memory is not touched, so pages that are given back are never faulted in just to be discarded.
+ * It returns true, private anonymous pages read back as zeros after MADV_DONTNEED. */
 
-void
+bool
 kernel_reset(void *ptr, size_t size) {
-#ifdef DEBUG_KERNEL_RESET
-    memset(ptr, 0x7e, size);
-#endif
     if (madvise(ptr, size, MADV_DONTNEED) < 0)
         failed_kernel_reset();
+    return true;
+}
+
+/* kernel_reset_lazy() function lets the kernel take the pages of memory previously allocated by kernel_alloc()
+ * when it runs short of memory. To do that it uses madvise() system call with MADV_FREE (Linux 4.5 and later):
+ * pages that are written again before the kernel takes them keep their contents and cost no page fault.
+ * If the kernel does not know MADV_FREE, kernel_reset() is used from then on.
+ * It returns true if the memory reads back as zeros, which is only the case after kernel_reset(). */
+
+bool
+kernel_reset_lazy(void *ptr, size_t size) {
+#ifdef MADV_FREE
+    static atomic_bool unsupported;
+
+    if (!atomic_load_explicit(&unsupported, memory_order_relaxed)) {
+        if (madvise(ptr, size, MADV_FREE) == 0)
+            return false;
+        if (errno != EINVAL)
+            failed_kernel_reset();
+        atomic_store_explicit(&unsupported, true, memory_order_relaxed);
+    }
+#endif
+    return kernel_reset(ptr, size);
+}
+
+/* kernel_write() function writes the whole buffer to the file descriptor with write(),
+ * which is async-signal-safe, so it may be called from a signal handler.
+ * A write interrupted by a signal is restarted. It returns false if write() fails. */
+
+bool
+kernel_write(int fd, const void *buf, size_t size) {
+    ssize_t written;
+
+    while (size != 0) {
+        written = write(fd, buf, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf = (const char *)buf + written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+/* kernel_backtrace() function stores the return addresses of the calling functions, innermost first,
+ * and returns their number. It uses backtrace() of the GNU C library, which loads the unwinder on its first call,
+ * so the caller must not be inside the allocator already when that call allocates. Other C libraries get no frames. */
+
+size_t
+kernel_backtrace(void **frames, size_t depth) {
+#ifdef __GLIBC__
+    int count;
+
+    count = backtrace(frames, depth > INT_MAX ? INT_MAX : (int)depth);
+    return count > 0 ? (size_t)count : 0;
+#else
+    (void)frames;
+    (void)depth;
+    return 0;
+#endif
+}
+
+/* kernel_symbol() function returns the name of the function the address is in,
+ * or NULL if dladdr() does not know it (static functions, stripped programs). Nothing is allocated. */
+
+const char *
+kernel_symbol(const void *addr) {
+    Dl_info info;
+
+    if (dladdr(addr, &info) == 0)
+        return NULL;
+    return info.dli_sname;
+}
+
+/* kernel_write_maps() function copies the memory map of the process (/proc/self/maps) to the file descriptor,
+ * through a buffer on the stack. It returns false if the map cannot be read or written. */
+
+bool
+kernel_write_maps(int fd) {
+    char buf[1024];
+    ssize_t count;
+    int maps;
+    bool ok = true;
+
+    maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0)
+        return false;
+    while (ok && (count = read(maps, buf, sizeof(buf))) != 0) {
+        if (count < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        ok = kernel_write(fd, buf, (size_t)count);
+    }
+    close(maps);
+    return ok;
 }
 
 //Conditional code for Windows
 #else
 #include <Windows.h>
+#include <io.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 /* kernel_alloc() function allocates memory for the kernel.
  * It uses VirtualAlloc() function for memory reservation and allocation.
@@ -121,6 +315,43 @@ kernel_alloc(size_t size) {
 }
 
 
+/* kernel_alloc_aligned() function allocates memory for the kernel, so that the address offset bytes
+ * into the memory is aligned to alignment. Memory reserved by VirtualAlloc() cannot be released in parts,
+ * so a larger region is reserved to find an aligned address, released and allocated again at that address.
+ * Another thread may take the address in between, then the whole procedure is repeated. */
+
+void *
+kernel_alloc_aligned(size_t size, size_t alignment, size_t offset) {
+    char *ptr, *ptr_aligned;
+
+    if (size > SIZE_MAX - alignment) {
+        return NULL;
+    }
+    for (;;) {
+        ptr = VirtualAlloc(NULL, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+        if (ptr == NULL) {
+            return NULL;
+        }
+        ptr_aligned = (char *)((((uintptr_t)ptr + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - offset);
+        VirtualFree(ptr, 0, MEM_RELEASE);
+        ptr = VirtualAlloc(ptr_aligned, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+}
+
+
+/* kernel_alloc_huge() function allocates memory for the kernel aligned to the huge page size.
+ * Large pages of Windows need the SeLockMemoryPrivilege and cannot be released in parts,
+ * so the memory is backed with normal pages. */
+
+void *
+kernel_alloc_huge(size_t size, size_t huge_page_size) {
+    return kernel_alloc_aligned(size, huge_page_size, 0);
+}
+
+
 /* kernel_free() function releases memory previously allocated by kernel_alloc().
  * To do that it uses VirtualFree() function for memory release. */
 
@@ -132,17 +363,99 @@ kernel_free(void *ptr, size_t size) {
 }
 
 
+/* kernel_realloc() function changes the size of memory previously allocated by kernel_alloc().
+ * Memory reserved by VirtualAlloc() cannot grow, so only shrinking succeeds: the pages of the tail are decommitted,
+ * the whole region is still released by kernel_free(). It returns NULL if the memory would have to grow. */
+
+void *
+kernel_realloc(void *ptr, size_t size_old, size_t size_new) {
+    if (size_new > size_old) {
+        return NULL;
+    }
+    if (size_new < size_old && VirtualFree((char *)ptr + size_new, size_old - size_new, MEM_DECOMMIT) == 0) {
+        failed_kernel_free();
+    }
+    return ptr;
+}
+
+/* kernel_page_size() function returns the size of a page of the system, the unit of MEM_RESET.
+ * It asks GetSystemInfo() once and remembers the answer. */
+
+size_t
+kernel_page_size(void) {
+    static atomic_size_t page_size;
+    SYSTEM_INFO info;
+    size_t size;
+
+    size = atomic_load_explicit(&page_size, memory_order_relaxed);
+    if (size == 0) {
+        GetSystemInfo(&info);
+        size = info.dwPageSize;
+        atomic_store_explicit(&page_size, size, memory_order_relaxed);
+    }
+    return size;
+}
+
 /* kernel_reset() function resets the values of memory previously allocated by kernel_alloc().
  * To do that it uses VirtualAlloc() function with the MEM_RESET flag for memory resetting.
- * If the VirtualAlloc()  call fails, it calls the failed_kernel_reset() function. */
+ * If the VirtualAlloc()  call fails, it calls the failed_kernel_reset() function.
+ * It returns false, MEM_RESET keeps the old contents until the pages are reused. */
 
-void
+bool
 kernel_reset(void *ptr, size_t size) {
-#ifdef DEBUG_KERNEL_RESET
-    memset(ptr, 0x7e, size);
-#endif
     if (ViraulAlloc(ptr, size, MEM_RESET, PAGE_READWRITE) == NULL)
         failed_kernel_reset();
+    return false;
+}
+
+/* kernel_reset_lazy() function lets the kernel take the pages of memory previously allocated by kernel_alloc().
+ * MEM_RESET is lazy already, so it is the same as kernel_reset(). */
+
+bool
+kernel_reset_lazy(void *ptr, size_t size) {
+    return kernel_reset(ptr, size);
+}
+
+/* kernel_write() function writes the whole buffer to the file descriptor with _write().
+ * It returns false if _write() fails. */
+
+bool
+kernel_write(int fd, const void *buf, size_t size) {
+    int written;
+
+    while (size != 0) {
+        written = _write(fd, buf, size > INT_MAX ? INT_MAX : (unsigned int)size);
+        if (written < 0) {
+            return false;
+        }
+        buf = (const char *)buf + written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+/* kernel_backtrace() function stores the return addresses of the calling functions, innermost first,
+ * with CaptureStackBackTrace() and returns their number. */
+
+size_t
+kernel_backtrace(void **frames, size_t depth) {
+    return CaptureStackBackTrace(0, depth > 62 ? 62 : (DWORD)depth, frames, NULL);
+}
+
+/* kernel_symbol() function returns NULL, names of functions need the debug help library on Windows. */
+
+const char *
+kernel_symbol(const void *addr) {
+    (void)addr;
+    return NULL;
+}
+
+/* kernel_write_maps() function writes nothing, there is no text memory map on Windows. */
+
+bool
+kernel_write_maps(int fd) {
+    (void)fd;
+    return true;
 }
 
 #endif /* deined(_WIN32) || defined(_WIN64) */
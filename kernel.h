@@ -1,3 +1,14 @@
+#include <stdbool.h>
+
 void *kernel_alloc(size_t);
+void *kernel_alloc_aligned(size_t, size_t, size_t);
+void *kernel_alloc_huge(size_t, size_t);
 void kernel_free(void *, size_t);
-void kernel_reset(void *, size_t);
+void *kernel_realloc(void *, size_t, size_t);
+size_t kernel_page_size(void);
+bool kernel_reset(void *, size_t);
+bool kernel_reset_lazy(void *, size_t);
+bool kernel_write(int, const void *, size_t);
+size_t kernel_backtrace(void **, size_t);
+const char *kernel_symbol(const void *);
+bool kernel_write_maps(int);
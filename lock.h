@@ -0,0 +1,29 @@
+#include "config.h"
+
+#if ALLOCATOR_THREADS
+#include <pthread.h>
+
+typedef pthread_mutex_t lock_type;
+typedef pthread_once_t once_type;
+
+#define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define lock_init(l) pthread_mutex_init((l), NULL)
+#define lock_acquire(l) pthread_mutex_lock(l)
+#define lock_try(l) (pthread_mutex_trylock(l) == 0)
+#define lock_release(l) pthread_mutex_unlock(l)
+
+#define ONCE_INITIALIZER PTHREAD_ONCE_INIT
+#define once_call(o, f) pthread_once((o), (f))
+#else
+typedef char lock_type;
+typedef char once_type;
+
+#define LOCK_INITIALIZER 0
+#define lock_init(l) ((void)(l))
+#define lock_acquire(l) ((void)(l))
+#define lock_try(l) ((void)(l), 1)
+#define lock_release(l) ((void)(l))
+
+#define ONCE_INITIALIZER 0
+#define once_call(o, f) ((void)(*(o) == 0 && ((*(o) = 1), f(), 1)))
+#endif
@@ -21,19 +21,19 @@ int main(void)
 
     // A minimum size for allocating a block is 64 bytes, so if we try anything below that, it will alloc 64
     ptr2 = mem_alloc(5);
-    printf("Allocated memory for ptr2 : %zu\n", payload_to_block(ptr2)->size_curr);
+    printf("Allocated memory for ptr2 : %zu\n", block_get_size_curr(payload_to_block(ptr2)));
 
   
     ptr3 = mem_alloc(543);
-    printf("Allocated memory for ptr3: %zu\n", payload_to_block(ptr3)->size_curr);
+    printf("Allocated memory for ptr3: %zu\n", block_get_size_curr(payload_to_block(ptr3)));
 
     ptr4 = mem_alloc(4096);
-    printf("Allocated memory for ptr4: %zu\n", payload_to_block(ptr4)->size_curr);
+    printf("Allocated memory for ptr4: %zu\n", block_get_size_curr(payload_to_block(ptr4)));
 
     mem_show("Result of allocations");
 
     ptr5 = mem_alloc(543);
-    printf("\n\nAllocated memory for ptr5: %zu\n\n", payload_to_block(ptr5)->size_curr);
+    printf("\n\nAllocated memory for ptr5: %zu\n\n", block_get_size_curr(payload_to_block(ptr5)));
 
     mem_show("Result of another allocation");
 
@@ -42,13 +42,24 @@ int main(void)
     
     mem_free(ptr5);
     mem_show("\nFree ptr5");
-    printf("\nWhat happaned to ptr5: %zu\n", payload_to_block(ptr5)->size_curr);
+    printf("\nWhat happaned to ptr5: %zu\n", block_get_size_curr(payload_to_block(ptr5)));
 
 
     mem_realloc(ptr4, 2543);
     mem_show("\nReallocate ptr4 -> 2543");
-    printf("\nNew allocated memory for ptr4: %zu\n", payload_to_block(ptr4)->size_curr);
+    printf("\nNew allocated memory for ptr4: %zu\n", block_get_size_curr(payload_to_block(ptr4)));
+
+    printf("\nMemory consumed per allocation:\n");
+    tester_overhead();
+
+    printf("\nHeap profiler with slab objects: %s\n", tester_prof_slab() ? "ok" : "failed");
+    printf("Memory given back after everything is freed: %s\n", tester_trim() ? "ok" : "failed");
+    printf("Zeroed memory from mem_calloc(): %s\n", tester_calloc() ? "ok" : "failed");
+    printf("Blocks resized in place by mem_realloc(): %s\n", tester_realloc() ? "ok" : "failed");
+    printf("Aligned blocks from mem_aligned_alloc(): %s\n", tester_aligned() ? "ok" : "failed");
+    printf("Arenas of the heap dump: %s\n", tester_dump() ? "ok" : "failed");
+    printf("Records of the allocation trace: %s\n", tester_trace() ? "ok" : "failed");
 
     //srand(time(NULL));
-    //tester(true);
+    printf("Random allocations, reallocations and frees: %s\n", tester(false) ? "ok" : "failed");
 }
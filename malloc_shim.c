@@ -0,0 +1,178 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "allocator_impl.h"
+#include "config.h"
+#include "kernel.h"
+
+/* Replacement of the C library allocator, build it with 'make liballoc_shim.so' and run
+ *
+ *     LD_PRELOAD=./liballoc_shim.so program
+ *
+ * to serve every malloc() of an unmodified program with mem_alloc().
+ *
+ * Nothing here is forwarded to the C library allocator, so there is no dlsym() lookup
+ * that could call malloc() again before it is resolved: the allocator itself only uses
+ * mmap()/munmap()/madvise() and pthread primitives that never allocate, and its state
+ * is statically initialized, so the very first malloc() of the dynamic loader is served as is.
+ * Every entry point is thread-safe because mem_alloc(), mem_free() and mem_realloc() are.
+ *
+ * With MEM_TRACE=file in the environment every call is traced into the file, see mem_trace_start(),
+ * and the trace can be run again with the replay tool. */
+
+// Function that allocates memory aligned to the power of two alignment
+static void *shim_memalign(size_t alignment, size_t size) {
+    void *ptr;
+
+    ptr = mem_aligned_alloc(alignment, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+// Function that checks if the value is a power of two
+static inline bool shim_power_of_two(size_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+void *malloc(size_t size) {
+    void *ptr;
+
+    ptr = mem_alloc(size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    mem_free(ptr);
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr;
+
+    ptr = mem_calloc(count, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *ptr2;
+
+    if (ptr != NULL && size == 0) {
+        mem_free(ptr);
+        return NULL;
+    }
+    ptr2 = mem_realloc(ptr, size);
+    if (ptr2 == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr2;
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *ptr2;
+
+    if (!shim_power_of_two(alignment) || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    ptr2 = shim_memalign(alignment, size);
+    if (ptr2 == NULL) {
+        return ENOMEM;
+    }
+    *ptr = ptr2;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (!shim_power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return shim_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (alignment > SIZE_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // Like the C library, treat an alignment that every block has (0 as well) as none
+    if (alignment <= ALIGN) {
+        return malloc(size);
+    }
+    // and round an alignment that is not a power of two up to the next one
+    while (!shim_power_of_two(alignment)) {
+        alignment = (alignment | (alignment - 1)) + 1;
+    }
+    return shim_memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return shim_memalign(kernel_page_size(), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page_size = kernel_page_size();
+
+    if (size > SIZE_MAX - page_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return shim_memalign(page_size, ROUND(size, page_size));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mem_usable_size(ptr);
+}
+
+static int shim_trace_fd = -1;
+
+/* Function shim_init() runs when the library is loaded and installs the fork handlers,
+ * so a child of a multithreaded process never inherits a locked heap.
+ * It starts tracing if MEM_TRACE names a file. */
+__attribute__((constructor))
+static void shim_init(void) {
+    const char *path;
+
+    pthread_atfork(mem_fork_prepare, mem_fork_parent, mem_fork_child);
+    path = getenv("MEM_TRACE");
+    if (path != NULL && *path != '\0') {
+        shim_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (shim_trace_fd >= 0 && !mem_trace_start(shim_trace_fd)) {
+            close(shim_trace_fd);
+            shim_trace_fd = -1;
+        }
+    }
+}
+
+// Function shim_fini() runs when the program exits and writes out the rest of the trace
+__attribute__((destructor))
+static void shim_fini(void) {
+    if (shim_trace_fd >= 0) {
+        mem_trace_stop();
+        close(shim_trace_fd);
+        shim_trace_fd = -1;
+    }
+}
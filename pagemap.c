@@ -0,0 +1,94 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "config.h"
+#include "kernel.h"
+#include "pagemap.h"
+
+/* The map is a two-level radix tree over page numbers of a 48-bit address space.
+ * Pages are pages of the kernel, the root is large enough for the smallest page size of 4 KiB.
+ * The root is a static array of pointers to leaves, a leaf is a bitmap of PAGEMAP_LEAF_BITS pages
+ * allocated with kernel_alloc() the first time one of its pages is marked and never released.
+ * The root is in .bss, so pages of it that are never used are never touched. */
+#define PAGEMAP_ADDRESS_BITS 48
+#define PAGEMAP_PAGE_SHIFT_MIN 12	// log2 of the smallest page size
+#define PAGEMAP_LEAF_SHIFT 18
+#define PAGEMAP_LEAF_BITS ((size_t)1 << PAGEMAP_LEAF_SHIFT)
+#define PAGEMAP_ROOT_SIZE ((size_t)1 << (PAGEMAP_ADDRESS_BITS - PAGEMAP_PAGE_SHIFT_MIN - PAGEMAP_LEAF_SHIFT))
+#define PAGEMAP_LEAF_SIZE (PAGEMAP_LEAF_BITS / CHAR_BIT)
+
+typedef _Atomic(uint64_t) pagemap_word;
+
+static _Atomic(pagemap_word *) pagemap_root[PAGEMAP_ROOT_SIZE];
+
+// Function that returns the number of the page containing ptr
+static inline uintptr_t pagemap_page(const void *ptr) {
+    return (uintptr_t)ptr >> __builtin_ctzll(kernel_page_size());
+}
+
+// Function that returns the leaf covering the page, allocating it if asked to
+static pagemap_word *pagemap_leaf(uintptr_t page, bool create) {
+    pagemap_word *leaf, *expected;
+    size_t idx;
+
+    idx = (size_t)(page >> PAGEMAP_LEAF_SHIFT);
+    leaf = atomic_load_explicit(&pagemap_root[idx], memory_order_acquire);
+    if (leaf != NULL || !create) {
+        return leaf;
+    }
+
+    leaf = kernel_alloc(PAGEMAP_LEAF_SIZE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    // Another thread may have installed the leaf meanwhile, then use its leaf
+    expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&pagemap_root[idx], &expected, leaf,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        kernel_free(leaf, PAGEMAP_LEAF_SIZE);
+        leaf = expected;
+    }
+    return leaf;
+}
+
+/* Function pagemap_set() marks the page containing ptr as a slab page (or clears the mark).
+ * It returns false if a new leaf of the map was needed and could not be allocated. */
+bool pagemap_set(const void *ptr, bool slab) {
+    pagemap_word *leaf;
+    uintptr_t page;
+    uint64_t bit;
+
+    page = pagemap_page(ptr);
+    leaf = pagemap_leaf(page, slab);
+    if (leaf == NULL) {
+        return !slab;
+    }
+    page &= PAGEMAP_LEAF_BITS - 1;
+    bit = (uint64_t)1 << (page % 64);
+    if (slab) {
+        atomic_fetch_or_explicit(&leaf[page / 64], bit, memory_order_release);
+    } else {
+        atomic_fetch_and_explicit(&leaf[page / 64], ~bit, memory_order_release);
+    }
+    return true;
+}
+
+// Function pagemap_get() checks if ptr points into a page marked as a slab page
+bool pagemap_get(const void *ptr) {
+    pagemap_word *leaf;
+    uintptr_t page;
+
+    if ((uintptr_t)ptr >> PAGEMAP_ADDRESS_BITS != 0) {
+        return false;
+    }
+    page = pagemap_page(ptr);
+    leaf = pagemap_leaf(page, false);
+    if (leaf == NULL) {
+        return false;
+    }
+    page &= PAGEMAP_LEAF_BITS - 1;
+    return (atomic_load_explicit(&leaf[page / 64], memory_order_acquire) >> (page % 64) & 1) != 0;
+}
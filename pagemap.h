@@ -0,0 +1,10 @@
+#include <stdbool.h>
+
+/* Page map: one bit per page of the address space telling whether the page belongs to a slab.
+ * Lookups are lock-free, so mem_free() can ask about any pointer. */
+
+// Function that marks or unmarks the page as a slab page, it returns false if the map could not grow
+bool pagemap_set(const void *, bool);
+
+// Function that checks if the pointer points into a page marked as a slab page
+bool pagemap_get(const void *);
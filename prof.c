@@ -0,0 +1,290 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "config.h"
+#include "kernel.h"
+#include "lock.h"
+#include "prof.h"
+
+// Number of lists of the hash table of samples
+#define PROF_BUCKETS 4096
+// Samples are carved from chunks of that many bytes mapped from the kernel
+#define PROF_CHUNK (64 * 1024)
+/* Bytes a thread allocates before it looks again whether the profiler has been started.
+ * So an allocation that is not sampled never reads anything shared. */
+#define PROF_RECHECK (1024 * 1024)
+/* Frames of the allocator at the top of a call stack: prof_sample() and block_sample().
+ * The next one is mem_alloc() or another entry point, unless it has been inlined into its caller. */
+#define PROF_SKIP 2
+
+/* Sample of a live block. Samples are hashed by the address of their block,
+ * unused ones are kept on a free list, the memory of samples is never given back. */
+struct prof_sample {
+    struct prof_sample *next;	// Next sample in the list of the bucket or the free list
+    const void *ptr;
+    size_t size;		// Size requested
+    size_t depth;		// Number of return addresses in stack
+    void *stack[ALLOCATOR_PROF_DEPTH];
+};
+
+_Thread_local int64_t prof_left;
+static _Thread_local uint64_t prof_random;	// State of the random number generator of the thread
+static _Thread_local bool prof_busy;		// The thread takes a sample, allocations of backtrace() are not sampled
+static atomic_bool prof_enabled;
+static atomic_size_t prof_interval = ALLOCATOR_PROF_INTERVAL;
+static lock_type prof_lock = LOCK_INITIALIZER;	// Protects the table and the free list of samples
+static struct prof_sample *prof_table[PROF_BUCKETS];
+static struct prof_sample *prof_free_list;
+static size_t prof_count;			// Number of live samples
+
+// Function that returns the bucket of the hash table for the address of a block
+static inline size_t prof_bucket(const void *ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 40) % PROF_BUCKETS;
+}
+
+// Function that returns the natural logarithm of u > 0, the allocator does not link the math library
+static double prof_log(double u) {
+    double z, z2;
+    int e = 0;
+
+    while (u < 0.5) {
+        u *= 2;
+        --e;
+    }
+    while (u > 1) {
+        u /= 2;
+        ++e;
+    }
+    // ln(u) = 2 atanh(z) for u in [0.5, 1], where |z| <= 1/3
+    z = (u - 1) / (u + 1);
+    z2 = z * z;
+    return 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 * (1.0 / 9 + z2 / 11)))))
+           + e * 0.6931471805599453;
+}
+
+// Function that returns e to the power of -x for x >= 0
+static double prof_exp_neg(double x) {
+    double result = 1, term = 1, f;
+    unsigned int n;
+
+    if (x > 700) {
+        return 0;
+    }
+    n = (unsigned int)x;
+    f = x - n;
+    for (unsigned int i = 1; i < 16; ++i) {
+        term *= -f / i;
+        result += term;
+    }
+    while (n-- > 0) {
+        result *= 0.36787944117144233;
+    }
+    return result;
+}
+
+/* Function prof_next() returns the number of bytes until the next sample of the thread:
+ * an exponential distribution with the mean of the sampling interval, so every byte allocated
+ * has the same chance to be sampled whatever the sizes of allocations are. */
+static int64_t prof_next(size_t interval) {
+    double next;
+
+    if (prof_random == 0) {
+        prof_random = ((uintptr_t)&prof_random ^ (uint64_t)time(NULL) * UINT64_C(0x9e3779b97f4a7c15)) | 1;
+    }
+    // xorshift64*, its top 53 bits make u in (0, 1]
+    prof_random ^= prof_random >> 12;
+    prof_random ^= prof_random << 25;
+    prof_random ^= prof_random >> 27;
+    next = -prof_log((double)((prof_random * UINT64_C(0x2545f4914f6cdd1d) >> 11) + 1) / 9007199254740992.0)
+           * (double)interval;
+    return next < 1 ? 1 : next > (double)INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t)next;
+}
+
+/* Function prof_sample() is called when the countdown of the thread runs out.
+ * It draws the next countdown and records the call stack of the block.
+ * If the profiler is not running, it just looks again after PROF_RECHECK bytes.
+ * It returns false if the block is not sampled: the profiler is not running, there is no block
+ * or no memory for the sample, or the thread is taking a sample already. */
+__attribute__((noinline))
+bool prof_sample(void *ptr, size_t size) {
+    struct prof_sample *sample, **bucket;
+    void *stack[ALLOCATOR_PROF_DEPTH + PROF_SKIP];
+    size_t depth;
+    char *chunk;
+
+    if (prof_busy) {
+        return false;
+    }
+    if (!atomic_load_explicit(&prof_enabled, memory_order_relaxed)) {
+        prof_left = PROF_RECHECK;
+        return false;
+    }
+    prof_left = prof_next(atomic_load_explicit(&prof_interval, memory_order_relaxed));
+    if (ptr == NULL) {
+        return false;
+    }
+
+    prof_busy = true;
+    depth = kernel_backtrace(stack, ALLOCATOR_PROF_DEPTH + PROF_SKIP);
+    depth = depth > PROF_SKIP ? depth - PROF_SKIP : 0;
+
+    lock_acquire(&prof_lock);
+    if (prof_free_list == NULL) {
+	// The lock is held while mapping, but samples are rare and a chunk holds a few hundred
+        chunk = kernel_alloc(PROF_CHUNK);
+        if (chunk != NULL) {
+            for (sample = (struct prof_sample *)chunk; (char *)(sample + 1) <= chunk + PROF_CHUNK; ++sample) {
+                sample->next = prof_free_list;
+                prof_free_list = sample;
+            }
+        }
+    }
+    sample = prof_free_list;
+    if (sample != NULL) {
+        prof_free_list = sample->next;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->depth = depth;
+        for (size_t i = 0; i < depth; ++i) {
+            sample->stack[i] = stack[PROF_SKIP + i];
+        }
+        bucket = &prof_table[prof_bucket(ptr)];
+        sample->next = *bucket;
+        *bucket = sample;
+        ++prof_count;
+    }
+    lock_release(&prof_lock);
+    prof_busy = false;
+    return sample != NULL;
+}
+
+// Function prof_forget() removes the sample of the block from the table, it returns false if there is none
+bool prof_forget(void *ptr) {
+    struct prof_sample *sample, **link;
+
+    lock_acquire(&prof_lock);
+    for (link = &prof_table[prof_bucket(ptr)]; (sample = *link) != NULL; link = &sample->next) {
+        if (sample->ptr == ptr) {
+            *link = sample->next;
+            sample->next = prof_free_list;
+            prof_free_list = sample;
+            --prof_count;
+            break;
+        }
+    }
+    lock_release(&prof_lock);
+    return sample != NULL;
+}
+
+/* Function mem_prof_start() starts sampling allocations every interval bytes on average,
+ * every thread starts within PROF_RECHECK bytes of its allocations. */
+void mem_prof_start(size_t interval) {
+    atomic_store_explicit(&prof_interval, interval != 0 ? interval : ALLOCATOR_PROF_INTERVAL, memory_order_relaxed);
+    atomic_store_explicit(&prof_enabled, true, memory_order_relaxed);
+}
+
+// Function mem_prof_stop() stops sampling, samples of blocks that are still live are kept for mem_prof_dump()
+void mem_prof_stop(void) {
+    atomic_store_explicit(&prof_enabled, false, memory_order_relaxed);
+}
+
+// Function that writes a piece of a profile, it clears ok if the piece could not be formatted or written
+static void prof_write(int fd, const char *line, int length, bool *ok) {
+    if (length < 0) {
+        *ok = false;
+        return;
+    }
+    *ok = *ok && kernel_write(fd, line, (size_t)length);
+}
+
+/* Function prof_write_pprof() writes the samples in the legacy heap profile format of gperftools:
+ * a header with the totals and the sampling interval, a line per sample with its size and the return addresses,
+ * then the memory map of the process that tells pprof which binary an address belongs to.
+ * pprof scales the sampled sizes up itself. The caller must hold prof_lock. */
+static bool prof_write_pprof(int fd, size_t interval) {
+    struct prof_sample *sample;
+    char line[160];
+    size_t bytes = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < PROF_BUCKETS; ++i) {
+        for (sample = prof_table[i]; sample != NULL; sample = sample->next) {
+            bytes += sample->size;
+        }
+    }
+    prof_write(fd, line, snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                                  prof_count, bytes, prof_count, bytes, interval), &ok);
+    for (size_t i = 0; i < PROF_BUCKETS; ++i) {
+        for (sample = prof_table[i]; sample != NULL; sample = sample->next) {
+            prof_write(fd, line, snprintf(line, sizeof(line), "1: %zu [1: %zu] @", sample->size, sample->size), &ok);
+            for (size_t j = 0; j < sample->depth; ++j) {
+                prof_write(fd, line, snprintf(line, sizeof(line), " %p", sample->stack[j]), &ok);
+            }
+            prof_write(fd, "\n", 1, &ok);
+        }
+    }
+    prof_write(fd, "\nMAPPED_LIBRARIES:\n", 19, &ok);
+    return ok && kernel_write_maps(fd);
+}
+
+/* Function prof_write_folded() writes a line per sample: the frames from the outermost one in,
+ * by name if the dynamic linker knows it, by address otherwise, and the live bytes the sample stands for.
+ * A block of size s is sampled with probability 1 - exp(-s / interval), so it stands for s divided by that.
+ * The caller must hold prof_lock. */
+static bool prof_write_folded(int fd, size_t interval) {
+    struct prof_sample *sample;
+    const char *name;
+    char line[160];
+    double p;
+    bool ok = true;
+
+    for (size_t i = 0; i < PROF_BUCKETS; ++i) {
+        for (sample = prof_table[i]; sample != NULL; sample = sample->next) {
+            if (sample->depth == 0) {
+                prof_write(fd, "[unknown] ", 10, &ok);
+            }
+            for (size_t j = sample->depth; j-- > 0; ) {
+                name = kernel_symbol(sample->stack[j]);
+                if (name != NULL) {
+                    prof_write(fd, name, (int)strlen(name), &ok);
+                } else {
+                    prof_write(fd, line, snprintf(line, sizeof(line), "%p", sample->stack[j]), &ok);
+                }
+                prof_write(fd, j != 0 ? ";" : " ", 1, &ok);
+            }
+            p = 1 - prof_exp_neg((double)sample->size / (double)interval);
+            prof_write(fd, line, snprintf(line, sizeof(line), "%.0f\n", p > 0 ? (double)sample->size / p : 0), &ok);
+        }
+    }
+    return ok;
+}
+
+/* Function mem_prof_dump() writes the samples of the live blocks to the file descriptor in the format.
+ * Nothing is allocated. Sampling waits while the profile is written. It returns false if a write failed. */
+bool mem_prof_dump(int fd, enum mem_prof_format format) {
+    size_t interval = atomic_load_explicit(&prof_interval, memory_order_relaxed);
+    bool ok;
+
+    lock_acquire(&prof_lock);
+    ok = format == MEM_PROF_PPROF ? prof_write_pprof(fd, interval) : prof_write_folded(fd, interval);
+    lock_release(&prof_lock);
+    return ok;
+}
+
+void prof_fork_prepare(void) {
+    lock_acquire(&prof_lock);
+}
+
+void prof_fork_parent(void) {
+    lock_release(&prof_lock);
+}
+
+void prof_fork_child(void) {
+    lock_init(&prof_lock);
+}
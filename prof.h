@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes the calling thread may allocate before its next sample, see prof_sample()
+extern _Thread_local int64_t prof_left;
+
+// Function that counts an allocation and checks if it is due for a sample, this is all an unsampled one pays
+static inline bool prof_due(size_t size) {
+    return (prof_left -= (int64_t)size) < 0;
+}
+
+// Function that records the call stack of an allocation that is due, it returns false if the block is not sampled
+bool prof_sample(void *, size_t);
+
+// Function that forgets the sample of a block that is freed or reallocated, it returns false if there is none
+bool prof_forget(void *);
+
+// Functions that keep the table of samples consistent across fork(), see mem_fork_prepare()
+void prof_fork_prepare(void);
+void prof_fork_parent(void);
+void prof_fork_child(void);
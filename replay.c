@@ -0,0 +1,337 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "allocator.h"
+
+/* Replay of a trace written by mem_trace_start(), e.g. of a program run with
+ *
+ *     LD_PRELOAD=./liballoc_shim.so MEM_TRACE=trace.bin program
+ *
+ * The records of all threads are sorted by time and run in one thread, every traced pointer
+ * is mapped to the pointer the replayed call returned. So the allocation pattern of a real program
+ * (sizes, lifetimes, order) is run against mem_alloc() and, with -l, glibc malloc.
+ * The report shows throughput, the peak of live bytes, peak RSS and for mem_alloc() its statistics
+ * at the end of the trace, before the blocks that were never freed are released.
+ * Records of calls made at nearly the same time by different threads may come in the wrong order,
+ * so a free of an unknown pointer is skipped and an allocation at a live pointer replaces it. */
+
+struct allocator {
+    const char *name;
+    void *(*alloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*aligned_alloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    bool libc;
+};
+
+static const struct allocator allocators[] = {
+    { "mem_alloc", mem_alloc, mem_calloc, mem_aligned_alloc, mem_realloc, mem_free, false },
+    { "malloc", malloc, calloc, aligned_alloc, realloc, free, true },
+};
+
+// Live pointer of the replay: the traced pointer and what the replayed call returned for it
+struct slot {
+    uint64_t key;	// Traced pointer, 0 for an empty slot, SLOT_DELETED for a freed one
+    void *ptr;
+    size_t size;
+};
+
+#define SLOT_DELETED UINT64_MAX
+
+// Open addressing hash table of the live pointers, never more than half full
+struct table {
+    struct slot *slots;
+    size_t mask;
+};
+
+struct result {
+    uint64_t ops;
+    uint64_t skipped;	// Frees and reallocs of pointers that were not live
+    size_t live;	// Bytes requested by live allocations
+    size_t live_peak;
+    size_t live_end;	// Allocations never freed
+};
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t
+table_hash(uint64_t key, size_t mask)
+{
+    return (size_t)((key >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 20) & mask;
+}
+
+// Function that returns the slot of the key, or NULL if the key is not live
+static struct slot *
+table_find(struct table *t, uint64_t key)
+{
+    size_t i;
+
+    for (i = table_hash(key, t->mask); t->slots[i].key != 0; i = (i + 1) & t->mask)
+        if (t->slots[i].key == key)
+            return &t->slots[i];
+    return NULL;
+}
+
+// Function that returns an unused slot for the key, a freed one if possible, the key must not be live
+static struct slot *
+table_insert(struct table *t, uint64_t key)
+{
+    size_t i;
+
+    for (i = table_hash(key, t->mask); t->slots[i].key != 0 && t->slots[i].key != SLOT_DELETED; i = (i + 1) & t->mask)
+        ;
+    t->slots[i].key = key;
+    return &t->slots[i];
+}
+
+// Time of a record and its position in the file, the position keeps records of the same time in order
+struct record_key {
+    uint64_t time;
+    size_t index;
+};
+
+// Function that compares records by time, then by their position in the file
+static int
+record_cmp(const void *a, const void *b)
+{
+    const struct record_key *ka = a, *kb = b;
+
+    if (ka->time != kb->time)
+        return ka->time < kb->time ? -1 : 1;
+    return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+// Function that reads a trace, it returns the records sorted by time and their number
+static struct mem_trace_record *
+trace_read(const char *path, size_t *count, uint64_t *lost)
+{
+    struct mem_trace_record *records, *sorted;
+    struct record_key *keys;
+    uint64_t magic;
+    long size;
+    size_t n, i, j;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != MEM_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, (long)sizeof(magic), SEEK_SET);
+    n = ((size_t)size - sizeof(magic)) / sizeof(records[0]);
+    records = malloc((n != 0 ? n : 1) * sizeof(records[0]));
+    if (records == NULL || fread(records, sizeof(records[0]), n, f) != n) {
+        fprintf(stderr, "%s: cannot read the trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+
+    // Lost records are not calls, count them and drop the records
+    *lost = 0;
+    for (i = j = 0; i < n; ++i) {
+        if (records[i].op == MEM_TRACE_LOST)
+            *lost += records[i].size;
+        else if (records[i].op < MEM_TRACE_LOST)
+            records[j++] = records[i];
+    }
+
+    // qsort() moves the records, so their positions are sorted together with their times
+    keys = malloc((j != 0 ? j : 1) * sizeof(keys[0]));
+    sorted = malloc((j != 0 ? j : 1) * sizeof(sorted[0]));
+    if (keys == NULL || sorted == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < j; ++i) {
+        keys[i].time = records[i].time;
+        keys[i].index = i;
+    }
+    qsort(keys, j, sizeof(keys[0]), record_cmp);
+    for (i = 0; i < j; ++i)
+        sorted[i] = records[keys[i].index];
+    free(keys);
+    free(records);
+    *count = j;
+    return sorted;
+}
+
+// Function that forgets the live pointer at the key of a record, the memory is freed
+static void
+replay_free(const struct allocator *a, struct table *t, struct result *res, uint64_t key)
+{
+    struct slot *slot;
+
+    slot = table_find(t, key);
+    if (slot == NULL) {
+        ++res->skipped;
+        return;
+    }
+    a->free(slot->ptr);
+    res->live -= slot->size;
+    slot->key = SLOT_DELETED;
+}
+
+// Function that remembers the pointer returned for a traced one
+static void
+replay_add(const struct allocator *a, struct table *t, struct result *res, uint64_t key, void *ptr, size_t size)
+{
+    struct slot *slot;
+
+    if (ptr == NULL)
+        return;
+    if (key == 0) {
+        a->free(ptr);	// The traced call failed, nothing refers to the block
+        return;
+    }
+    if (table_find(t, key) != NULL)
+        replay_free(a, t, res, key);
+    slot = table_insert(t, key);
+    slot->ptr = ptr;
+    slot->size = size;
+    res->live += size;
+    if (res->live > res->live_peak)
+        res->live_peak = res->live;
+}
+
+static void
+replay_run(const struct allocator *a, const struct mem_trace_record *records, size_t count)
+{
+    const struct mem_trace_record *r;
+    struct result res = { 0 };
+    struct mem_stats stats;
+    struct table t;
+    struct slot *slot;
+    uint64_t start, elapsed;
+    size_t i, cap;
+    void *ptr;
+
+    for (cap = 16; cap < 2 * count; cap *= 2)
+        ;
+    t.slots = calloc(cap, sizeof(t.slots[0]));
+    t.mask = cap - 1;
+    if (t.slots == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    for (r = records; r < records + count; ++r) {
+        switch (r->op) {
+        case MEM_TRACE_ALLOC:
+            replay_add(a, &t, &res, r->ptr, a->alloc(r->size), r->size);
+            break;
+        case MEM_TRACE_CALLOC:
+            replay_add(a, &t, &res, r->ptr, a->calloc(r->result, r->size), r->result * r->size);
+            break;
+        case MEM_TRACE_ALIGNED_ALLOC:
+            replay_add(a, &t, &res, r->ptr, a->aligned_alloc(r->result, r->size), r->size);
+            break;
+        case MEM_TRACE_REALLOC:
+            if (r->ptr == 0) {
+                replay_add(a, &t, &res, r->result, a->realloc(NULL, r->size), r->size);
+                break;
+            }
+            slot = table_find(&t, r->ptr);
+            if (slot == NULL) {
+                ++res.skipped;
+                break;
+            }
+            // A failed realloc keeps the old block, mem_realloc() to size 0 does not free it like realloc() does
+            if (r->result == 0)
+                break;
+            ptr = a->realloc(slot->ptr, r->size != 0 ? r->size : 1);
+            if (ptr == NULL)
+                break;
+            res.live -= slot->size;
+            slot->key = SLOT_DELETED;
+            replay_add(a, &t, &res, r->result, ptr, r->size);
+            break;
+        case MEM_TRACE_FREE:
+            replay_free(a, &t, &res, r->ptr);
+            break;
+        }
+        ++res.ops;
+    }
+    elapsed = now_ns() - start;
+    res.live_end = res.live;
+
+    printf("%-10s %12" PRIu64 " ops %10.3f ms %8.2f Mops/s  live peak %10zu  never freed %10zu  skipped %" PRIu64 "\n",
+           a->name, res.ops, (double)elapsed / 1e6, elapsed ? (double)res.ops * 1e3 / (double)elapsed : 0.0,
+           res.live_peak, res.live_end, res.skipped);
+    if (!a->libc) {
+        mem_stats(&stats);
+        printf("%-10s mapped %zu busy %zu free %zu cached %zu arenas %zu large %zu fragmentation %.3f\n",
+               "", stats.mapped, stats.busy, stats.free, stats.cached, stats.arenas, stats.large,
+               stats.fragmentation);
+    }
+
+    for (i = 0; i < cap; ++i)
+        if (t.slots[i].key != 0 && t.slots[i].key != SLOT_DELETED)
+            a->free(t.slots[i].ptr);
+    free(t.slots);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l] trace\n"
+            "  -l  replay the trace against glibc malloc as well\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct mem_trace_record *records;
+    struct rusage ru;
+    size_t count, i;
+    uint64_t lost;
+    bool libc = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "l")) != -1) {
+        switch (c) {
+        case 'l': libc = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        usage(argv[0]);
+
+    records = trace_read(argv[optind], &count, &lost);
+    printf("%zu records", count);
+    if (lost != 0)
+        printf(", %" PRIu64 " lost while tracing, the replay is incomplete", lost);
+    printf("\n");
+
+    for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); ++i)
+        if (!allocators[i].libc || libc)
+            replay_run(&allocators[i], records, count);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        printf("peak RSS of the replay %ld KiB\n", ru.ru_maxrss);
+    free(records);
+    return 0;
+}
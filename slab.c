@@ -0,0 +1,224 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "allocator.h"
+#include "allocator_impl.h"
+#include "config.h"
+#include "kernel.h"
+#include "lock.h"
+#include "pagemap.h"
+#include "slab.h"
+
+#define SLAB_OBJECT_ALIGN sizeof(void *)
+#define SLAB_OBJECT_MIN sizeof(void *)
+
+/* Structure at the start of every slab page.
+ * Objects follow the header and carry no header of their own,
+ * a set bit in the bitmap means that the object with that index is free.
+ * A slab page is a page of the kernel, so the bitmap is as long as its size requires. */
+struct slab_page {
+    struct mem_slab *slab;	// Slab the page belongs to
+    struct slab_page *next;	// Next page of the slab with free objects
+    struct slab_page *prev;	// Previous page of the slab with free objects
+    size_t free;		// Number of free objects in the page
+    uint64_t bitmap[];		// slab_bitmap_words() words
+};
+
+/* Structure that represents a slab: a set of pages holding objects of one size. */
+struct mem_slab {
+    lock_type lock;		// Protects the pages of the slab
+    size_t size;		// Size of an object
+    size_t count;		// Number of objects in a page
+    size_t header;		// Size of the header of a page, the first object follows it
+    struct slab_page *pages;	// Pages with free objects
+};
+
+static atomic_bool slab_used;	// Any slab page has ever been created, mem_free() may skip the lookup otherwise
+
+// Function that returns the number of words in the bitmap of a page, enough for the smallest objects
+static inline size_t
+slab_bitmap_words(void)
+{
+    return kernel_page_size() / SLAB_OBJECT_MIN / 64;
+}
+
+// Function that returns the page containing the object
+static inline struct slab_page *
+object_to_page(const void *ptr)
+{
+    return (struct slab_page *)((uintptr_t)ptr & ~((uintptr_t)kernel_page_size() - 1));
+}
+
+// Function that returns the object with the given index in the page
+static inline void *
+page_to_object(struct slab_page *page, size_t idx)
+{
+    return (char *)page + page->slab->header + idx * page->slab->size;
+}
+
+// Function that adds the page to the list of pages with free objects
+static void slab_page_link(struct mem_slab *slab, struct slab_page *page) {
+    page->prev = NULL;
+    page->next = slab->pages;
+    if (slab->pages != NULL) {
+        slab->pages->prev = page;
+    }
+    slab->pages = page;
+}
+
+// Function that removes the page from the list of pages with free objects
+static void slab_page_unlink(struct mem_slab *slab, struct slab_page *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        slab->pages = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+/* Function slab_page_alloc() allocates a new page for the slab from the kernel,
+ * marks every object in it as free and registers the page in the page map.
+ * It returns NULL if the kernel or the page map is out of memory. */
+static struct slab_page *slab_page_alloc(struct mem_slab *slab) {
+    struct slab_page *page;
+    size_t idx;
+
+    page = kernel_alloc(kernel_page_size());
+    if (page == NULL) {
+        return NULL;
+    }
+    if (!pagemap_set(page, true)) {
+        kernel_free(page, kernel_page_size());
+        return NULL;
+    }
+    atomic_store_explicit(&slab_used, true, memory_order_relaxed);
+
+    page->slab = slab;
+    page->free = slab->count;
+    for (idx = 0; idx < slab_bitmap_words(); ++idx) {
+        page->bitmap[idx] = 0;
+    }
+    for (idx = 0; idx < slab->count; ++idx) {
+        page->bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+    }
+    return page;
+}
+
+// Function that returns a page of the slab to the kernel
+static void slab_page_free(struct slab_page *page) {
+    pagemap_set(page, false);
+    kernel_free(page, kernel_page_size());
+}
+
+/* Function mem_slab_create() creates a slab for objects of the given size.
+ * Objects are rounded up to a multiple of the pointer size and packed into pages
+ * of the kernel without per-object headers.
+ * It returns NULL if the size does not fit into a page or there is no memory. */
+struct mem_slab *mem_slab_create(size_t size) {
+    struct mem_slab *slab;
+    size_t header;
+
+    header = ROUND_BYTES(sizeof(struct slab_page) + slab_bitmap_words() * sizeof(uint64_t));
+    if (size < SLAB_OBJECT_MIN) {
+        size = SLAB_OBJECT_MIN;
+    }
+    if (size > kernel_page_size() - header) {
+        return NULL;
+    }
+    size = ROUND(size, SLAB_OBJECT_ALIGN);
+
+    slab = mem_alloc(sizeof(*slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    lock_init(&slab->lock);
+    slab->size = size;
+    slab->header = header;
+    slab->count = (kernel_page_size() - header) / size;
+    slab->pages = NULL;
+    return slab;
+}
+
+/* Function mem_slab_destroy() releases all pages of the slab and the slab itself.
+ * Every object of the slab must have been freed before. */
+void mem_slab_destroy(struct mem_slab *slab) {
+    struct slab_page *page, *page_n;
+
+    if (slab == NULL) {
+        return;
+    }
+    for (page = slab->pages; page != NULL; page = page_n) {
+        page_n = page->next;
+        slab_page_free(page);
+    }
+    mem_free(slab);
+}
+
+/* Function mem_slab_alloc() allocates an object from the slab.
+ * It takes the first free object of the first page with free objects, creating a page if there is none.
+ * It returns NULL if no page could be allocated. */
+void *mem_slab_alloc(struct mem_slab *slab) {
+    struct slab_page *page;
+    size_t word, bit;
+
+    lock_acquire(&slab->lock);
+    page = slab->pages;
+    if (page == NULL) {
+        page = slab_page_alloc(slab);
+        if (page == NULL) {
+            lock_release(&slab->lock);
+            return NULL;
+        }
+        slab_page_link(slab, page);
+    }
+
+    for (word = 0; page->bitmap[word] == 0; ++word)
+        ;
+    bit = (size_t)__builtin_ctzll(page->bitmap[word]);
+    page->bitmap[word] &= ~((uint64_t)1 << bit);
+
+    // A page without free objects leaves the list until one of its objects is freed
+    if (--page->free == 0) {
+        slab_page_unlink(slab, page);
+    }
+    lock_release(&slab->lock);
+    return page_to_object(page, word * 64 + bit);
+}
+
+// Function that checks if the pointer is an object allocated from a slab
+bool slab_owns(const void *ptr) {
+    return atomic_load_explicit(&slab_used, memory_order_relaxed) && pagemap_get(ptr);
+}
+
+// Function that returns the size of an object allocated from a slab
+size_t slab_object_size(const void *ptr) {
+    return object_to_page(ptr)->slab->size;
+}
+
+/* Function slab_free() returns an object to its slab.
+ * A page that becomes completely free is returned to the kernel
+ * unless it is the only page of the slab with free objects. */
+void slab_free(void *ptr) {
+    struct slab_page *page;
+    struct mem_slab *slab;
+    size_t idx;
+
+    page = object_to_page(ptr);
+    slab = page->slab;
+    idx = ((size_t)((char *)ptr - (char *)page) - slab->header) / slab->size;
+
+    lock_acquire(&slab->lock);
+    page->bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+    if (page->free++ == 0) {
+        slab_page_link(slab, page);
+    }
+    if (page->free == slab->count && (page->prev != NULL || page->next != NULL)) {
+        slab_page_unlink(slab, page);
+        slab_page_free(page);
+    }
+    lock_release(&slab->lock);
+}
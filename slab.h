@@ -0,0 +1,10 @@
+#include <stdbool.h>
+
+// Function that checks if the pointer is an object allocated from a slab
+bool slab_owns(const void *);
+
+// Function that returns the size of an object allocated from a slab
+size_t slab_object_size(const void *);
+
+// Function that returns an object to its slab
+void slab_free(void *);
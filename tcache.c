@@ -0,0 +1,128 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "allocator_impl.h"
+#include "block.h"
+#include "config.h"
+#include "lock.h"
+#include "tcache.h"
+
+#define TCACHE_BINS (ALLOCATOR_TCACHE_SIZE_MAX / ALIGN + 1)
+
+#if ALLOCATOR_THREADS
+
+/* Cached blocks keep their 'busy' flag, so neighbouring blocks never merge with them
+ * and nothing in their headers changes while they sit in a cache.
+ * Blocks of one size are linked through the first word of their payload. */
+struct tcache_bin {
+    Block *head;
+    size_t count;
+};
+
+struct tcache {
+    struct tcache_bin bins[TCACHE_BINS];
+    bool registered;	// Thread exit destructor is installed
+    bool disabled;	// Thread is exiting, do not cache anything any more
+};
+
+static _Thread_local struct tcache tcache;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Function that is called on thread exit and returns the cache of the thread
+static void tcache_destructor(void *arg) {
+    (void)arg;
+    tcache_flush();
+    tcache.disabled = true;
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destructor);
+}
+
+/* Function tcache_get() takes a block of the given aligned size from the cache of the calling thread.
+ * It returns NULL if the size is not cached or the bin of the size is empty. */
+Block *tcache_get(size_t size) {
+    struct tcache_bin *bin;
+    Block *block;
+
+    if (size > ALLOCATOR_TCACHE_SIZE_MAX) {
+        return NULL;
+    }
+    bin = &tcache.bins[size / ALIGN];
+    block = bin->head;
+    if (block != NULL) {
+        bin->head = *block_link(block);
+        --bin->count;
+    }
+    return block;
+}
+
+/* Function tcache_put() puts a busy block into the cache of the calling thread.
+ * It does not matter which thread allocated the block, remote frees are cached as well.
+ * If the bin of the size is full, half of it is returned to the allocator as one batch,
+ * so the allocator lock is taken once per ALLOCATOR_TCACHE_COUNT / 2 frees.
+ * It returns false if the block is not cached and has to be freed by the caller. */
+bool tcache_put(Block *block) {
+    struct tcache_bin *bin;
+    Block *chain, *last;
+    size_t size, n;
+
+    size = block_get_size_curr(block);
+    if (size > ALLOCATOR_TCACHE_SIZE_MAX || tcache.disabled) {
+        return false;
+    }
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+
+    bin = &tcache.bins[size / ALIGN];
+    if (bin->count >= ALLOCATOR_TCACHE_COUNT) {
+        // Detach the oldest half of the bin and release it in one batch
+        last = bin->head;
+        for (n = 1; n < ALLOCATOR_TCACHE_COUNT / 2; ++n) {
+            last = *block_link(last);
+        }
+        chain = *block_link(last);
+        *block_link(last) = NULL;
+        bin->count = ALLOCATOR_TCACHE_COUNT / 2;
+        blocks_release(chain);
+    }
+    *block_link(block) = bin->head;
+    bin->head = block;
+    ++bin->count;
+    return true;
+}
+
+// Function tcache_flush() returns every block cached by the calling thread to the allocator
+void tcache_flush(void) {
+    struct tcache_bin *bin;
+
+    for (bin = tcache.bins; bin < tcache.bins + TCACHE_BINS; ++bin) {
+        if (bin->head != NULL) {
+            blocks_release(bin->head);
+            bin->head = NULL;
+            bin->count = 0;
+        }
+    }
+}
+
+#else
+
+Block *tcache_get(size_t size) {
+    (void)size;
+    return NULL;
+}
+
+bool tcache_put(Block *block) {
+    (void)block;
+    return false;
+}
+
+void tcache_flush(void) {
+}
+
+#endif
@@ -0,0 +1,12 @@
+// Function that takes a cached block of exactly the given size from the calling thread's cache
+Block *tcache_get(size_t);
+
+// Function that puts a busy block into the calling thread's cache
+bool tcache_put(Block *);
+
+// Function that returns all blocks cached by the calling thread to the allocator
+void tcache_flush(void);
+
+/* Function that releases a chain of blocks linked through their payloads,
+ * taking the allocator lock once for the whole chain (defined in allocator.c). */
+void blocks_release(Block *);
@@ -1,10 +1,17 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "allocator.h"
+#include "allocator_impl.h"
+#include "block.h"
 #include "tester.h"
 
+// Header of the block before it was made compact (size_curr, size_prev and offset) and its minimum size
+#define LEGACY_BLOCK_STRUCT_SIZE ROUND_BYTES(3 * sizeof(size_t))
+#define LEGACY_BLOCK_SIZE_MIN ROUND_BYTES(sizeof(tree_node_type))
+
 struct T {
     void *ptr;
     size_t size;
@@ -39,7 +46,7 @@ buf_alloc(size_t size)
     return ptr;
 }
 
-void
+bool
 tester(const bool verbose)
 {
     const size_t t_NUM = 100;
@@ -60,7 +67,7 @@ tester(const bool verbose)
             if (t[idx].ptr != NULL)
                 if (buf_checksum(t[idx].ptr, t[idx].size) != t[idx].checksum) {
                     printf("1. Checksum failed at [%p]\n", t[idx].ptr);
-                    return;
+                    return false;
                 }
         }
         idx = (size_t)rand() % t_NUM;
@@ -91,7 +98,7 @@ tester(const bool verbose)
                     printf("-> [%p] %zu\n", ptr, size);
                 if (checksum != buf_checksum(ptr, size_min)) {
                     printf("2. Checksum failed at [%p]\n", ptr);
-                    return;
+                    return false;
                 }
                 buf_fill(ptr, size);
                 t[idx].ptr = ptr;
@@ -112,10 +119,573 @@ tester(const bool verbose)
         if (t[idx].ptr != NULL)
             if (buf_checksum(t[idx].ptr, t[idx].size) != t[idx].checksum) {
                 printf("3. Checksum failed at [%p]\n", t[idx].ptr);
-                return;
+                return false;
             }
         mem_free(t[idx].ptr);
     }
     if (verbose)
         mem_show("------------------------");
+    return true;
+}
+
+/* Function tester_overhead() compares memory consumed by small allocations with the requested sizes.
+ * For every size it allocates a number of blocks and sums their sizes together with their headers,
+ * then prints it next to an estimate of what the same blocks took with the legacy 32-byte header
+ * and what an object of that size takes in a slab. The legacy layout is not built any more,
+ * so its column is computed from the old header and minimum block size, not measured. */
+void
+tester_overhead(void)
+{
+    static const size_t sizes[] = { 8, 16, 24, 32, 48, 64, 100, 128, 256, 512 };
+    const size_t N = 1000;
+    void *ptrs[1000];
+    struct mem_slab *slab;
+    char *obj1, *obj2;
+    size_t i, idx, size, used, legacy;
+
+    printf("Minimum block size %zu bytes (a free block holds a %zu-byte tree node and its footer), header %zu bytes\n",
+           (size_t)BLOCK_SIZE_MIN, sizeof(tree_node_type), (size_t)BLOCK_STRUCT_SIZE);
+    printf("%8s %12s %12s %12s %12s\n", "size", "block", "overhead", "legacy est.", "slab");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        size = sizes[i];
+        used = 0;
+        for (idx = 0; idx < N; ++idx) {
+            ptrs[idx] = mem_alloc(size);
+            used += block_get_size_curr(payload_to_block(ptrs[idx])) + BLOCK_STRUCT_SIZE;
+        }
+        for (idx = 0; idx < N; ++idx)
+            mem_free(ptrs[idx]);
+        legacy = ROUND_BYTES(size < LEGACY_BLOCK_SIZE_MIN ? LEGACY_BLOCK_SIZE_MIN : size) + LEGACY_BLOCK_STRUCT_SIZE;
+
+        // Consecutive objects of a fresh slab are adjacent, their distance is the cost of one object
+        slab = mem_slab_create(size);
+        obj1 = mem_slab_alloc(slab);
+        obj2 = mem_slab_alloc(slab);
+        printf("%8zu %12zu %12zu %12zu %12td\n", size, used / N, used / N - size, legacy, obj2 - obj1);
+        mem_free(obj1);
+        mem_free(obj2);
+        mem_slab_destroy(slab);
+    }
+}
+
+// Function that counts the samples of the given size in a heap profile of the live blocks
+static size_t
+prof_count_size(size_t size)
+{
+    char line[256], prefix[64];
+    size_t count = 0;
+    FILE *f;
+
+    f = tmpfile();
+    if (f == NULL || !mem_prof_dump(fileno(f), MEM_PROF_PPROF))
+        return SIZE_MAX;
+    rewind(f);
+    snprintf(prefix, sizeof(prefix), "1: %zu [", size);
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            ++count;
+    fclose(f);
+    return count;
+}
+
+/* Function tester_prof_slab() reallocates an object of a slab in place while every allocation is sampled.
+ * Objects of slabs have no header, so their neighbours must keep their contents,
+ * the object must have one sample however often it is reallocated and none once it is freed. */
+bool
+tester_prof_slab(void)
+{
+    const size_t SIZE = 64, SIZE_SAMPLED = 37;
+    struct mem_slab *slab;
+    unsigned char *obj[3];
+    size_t i, idx, count;
+    bool ok = true;
+
+    slab = mem_slab_create(SIZE);
+    for (idx = 0; idx < 3; ++idx) {
+        obj[idx] = mem_slab_alloc(slab);
+        memset(obj[idx], 0xaa, SIZE);
+    }
+
+    // The first allocation uses up the countdown left from when the profiler was off
+    mem_prof_start(1);
+    mem_free(mem_alloc(2 * 1024 * 1024));
+    for (i = 0; i < 100; ++i) {
+        if (mem_realloc(obj[1], i % 2 ? SIZE : SIZE_SAMPLED) != obj[1]) {
+            printf("Slab object moved on realloc to a smaller size\n");
+            ok = false;
+        }
+    }
+    mem_realloc(obj[1], SIZE_SAMPLED);
+    for (idx = 0; idx < 3; idx += 2)
+        for (i = 0; i < SIZE; ++i)
+            if (obj[idx][i] != 0xaa) {
+                printf("Neighbour of a sampled slab object changed at [%p]\n", (void *)&obj[idx][i]);
+                ok = false;
+                break;
+            }
+    count = prof_count_size(SIZE_SAMPLED);
+    if (count != 1) {
+        printf("Reallocated slab object has %zu samples instead of 1\n", count);
+        ok = false;
+    }
+
+    for (idx = 0; idx < 3; ++idx)
+        mem_free(obj[idx]);
+    count = prof_count_size(SIZE_SAMPLED);
+    if (count != 0) {
+        printf("Freed slab object has %zu samples left\n", count);
+        ok = false;
+    }
+    mem_prof_stop();
+    mem_slab_destroy(slab);
+    return ok;
+}
+
+// Function that allocates blocks until the heap maps a new arena, it returns the bytes of the arena
+static size_t
+arena_probe(void **ptrs, size_t max, size_t *n)
+{
+    struct mem_stats s0, s;
+
+    mem_stats(&s0);
+    for (*n = 0; *n < max; ++*n) {
+        ptrs[*n] = mem_alloc(1000);
+        mem_stats(&s);
+        if (s.arenas > s0.arenas) {
+            ++*n;
+            return s.mapped - s0.mapped;
+        }
+    }
+    return 0;
+}
+
+/* Function tester_trim() allocates enough memory for arenas of the heap to grow to the max size,
+ * frees all of it and calls mem_trim(). No more memory may stay mapped than before,
+ * and the next arena may be no larger than the one mapped before the arenas grew. */
+bool
+tester_trim(void)
+{
+    const size_t N = 40000, PROBE_MAX = 20000;
+    void **ptrs;
+    struct mem_stats before, after;
+    size_t idx, n, arena1, arena2;
+    bool ok = true;
+
+    ptrs = malloc(N * sizeof(ptrs[0]));
+    mem_trim();
+    mem_stats(&before);
+    arena1 = arena_probe(ptrs, PROBE_MAX, &n);
+    for (idx = 0; idx < n; ++idx)
+        mem_free(ptrs[idx]);
+
+    for (idx = 0; idx < N; ++idx)
+        ptrs[idx] = mem_alloc((size_t)rand() % 8000 + 1);
+    for (idx = 0; idx < N; idx += 2)
+        mem_free(ptrs[idx]);
+    for (idx = 1; idx < N; idx += 2)
+        mem_free(ptrs[idx]);
+
+    mem_trim();
+    mem_stats(&after);
+    if (after.mapped > before.mapped || after.arenas > before.arenas) {
+        printf("Mapped %zu bytes in %zu arenas after everything was freed, %zu bytes in %zu arenas before\n",
+               after.mapped, after.arenas, before.mapped, before.arenas);
+        ok = false;
+    }
+
+    arena2 = arena_probe(ptrs, PROBE_MAX, &n);
+    for (idx = 0; idx < n; ++idx)
+        mem_free(ptrs[idx]);
+    if (arena1 == 0 || arena2 > arena1) {
+        printf("New arena of %zu bytes after the heap shrank, %zu bytes before it grew\n", arena2, arena1);
+        ok = false;
+    }
+    mem_trim();
+    free(ptrs);
+    return ok;
+}
+
+// Function that returns the offset of the first byte of the buffer that is not zero, the size if there is none
+static size_t
+buf_nonzero(const unsigned char *c, size_t size)
+{
+    size_t idx;
+
+    for (idx = 0; idx < size && c[idx] == 0; ++idx)
+        ;
+    return idx;
+}
+
+// Function that dirties a block of the given size, frees it, trims the heaps and checks a block from mem_calloc()
+static bool
+calloc_after_trim(size_t size, const char *what)
+{
+    unsigned char *c;
+    size_t off;
+
+    c = mem_alloc(size);
+    memset(c, 0xa5, size);
+    mem_free(c);
+    mem_trim();
+    c = mem_calloc(1, size);
+    off = buf_nonzero(c, size);
+    mem_free(c);
+    if (off != size) {
+        printf("Byte %zu of %zu from mem_calloc() is not zero %s\n", off, size, what);
+        return false;
+    }
+    return true;
+}
+
+/* Function tester_calloc() checks that mem_calloc() clears whatever it does not know to be zero:
+ * a block of several pages that was dirtied, freed and trimmed with either release strategy
+ * and a block that takes a whole arena reused from the arena cache. */
+bool
+tester_calloc(void)
+{
+    const size_t ARENA = 1024 * 1024;
+    size_t page_size = kernel_page_size(), size, off;
+    struct mem_stats s0, s;
+    unsigned char *c, *c_old;
+    bool ok = true;
+
+    ok &= calloc_after_trim(5 * page_size + 100, "after MEM_RELEASE_DONTNEED");
+    mem_set_release(MEM_RELEASE_FREE);
+    ok &= calloc_after_trim(5 * page_size + 100, "after MEM_RELEASE_FREE");
+    mem_set_release(MEM_RELEASE_DONTNEED);
+
+    // A block of the max size of a heap takes a new arena of its own, which goes to the arena cache once freed
+    mem_set_arena_size(ARENA, ARENA);
+    size = ARENA - ARENA_OVERHEAD;
+    mem_stats(&s0);
+    c_old = mem_alloc(size);
+    mem_stats(&s);
+    if (s.arenas != s0.arenas + 1) {
+        printf("Block of %zu bytes took no arena of its own\n", size);
+        ok = false;
+    }
+    memset(c_old, 0xa5, size);
+    mem_free(c_old);
+    c = mem_calloc(1, size);
+    if (c != c_old) {
+        printf("Arena of the block of %zu bytes was not reused from the arena cache\n", size);
+        ok = false;
+    }
+    off = buf_nonzero(c, size);
+    if (off != size) {
+        printf("Byte %zu of %zu from mem_calloc() is not zero in a reused arena\n", off, size);
+        ok = false;
+    }
+    mem_free(c);
+    mem_set_arena_size(ALLOCATOR_ARENA_PAGES * page_size, ALLOCATOR_ARENA_SIZE_MAX);
+    mem_trim();
+    return ok;
+}
+
+// Function that returns the index of the first of len blocks that follow each other in memory, n if there are none
+static size_t
+adjacent_run(void **ptrs, size_t n, size_t len)
+{
+    size_t idx, run = 1;
+
+    for (idx = 1; idx < n; ++idx) {
+        run = block_next(payload_to_block(ptrs[idx - 1])) == payload_to_block(ptrs[idx]) ? run + 1 : 1;
+        if (run == len)
+            return idx + 1 - len;
+    }
+    return n;
+}
+
+/* Function that grows a block into its free left neighbour, and its free right neighbour too if right is set.
+ * The block must move to the payload of the left neighbour with its contents, the busy blocks around must keep theirs. */
+static bool
+realloc_grow_left(bool right)
+{
+    const size_t N = 64, SIZE = 2000;
+    void *ptrs[64], *left, *ptr;
+    unsigned int checksums[64];
+    size_t idx, i;
+    bool ok = true;
+
+    for (idx = 0; idx < N; ++idx) {
+        ptrs[idx] = buf_alloc(SIZE);
+        checksums[idx] = buf_checksum(ptrs[idx], SIZE);
+    }
+    // Busy block, free left neighbour, the block, right neighbour and a busy block
+    i = adjacent_run(ptrs, N, 5);
+    if (i == N) {
+        printf("No 5 adjacent blocks of %zu bytes\n", SIZE);
+        ok = false;
+    } else {
+        left = ptrs[i + 1];
+        mem_free(ptrs[i + 1]);
+        ptrs[i + 1] = NULL;
+        if (right) {
+            mem_free(ptrs[i + 3]);
+            ptrs[i + 3] = NULL;
+        }
+        ptr = mem_realloc(ptrs[i + 2], (right ? 3 : 2) * SIZE);
+        if (ptr != left) {
+            printf("Block [%p] did not grow into its free left neighbour [%p]%s\n",
+                   ptrs[i + 2], left, right ? " and right one" : "");
+            ok = false;
+        }
+        ptrs[i + 2] = ptr;
+    }
+    for (idx = 0; idx < N; ++idx) {
+        if (ptrs[idx] != NULL && buf_checksum(ptrs[idx], SIZE) != checksums[idx]) {
+            printf("Checksum failed at [%p] after growing into the left neighbour\n", ptrs[idx]);
+            ok = false;
+        }
+        mem_free(ptrs[idx]);
+    }
+    return ok;
+}
+
+/* Function that shrinks a block that takes a whole arena, so it is the last block of the arena, and grows it back.
+ * The rest must become a free block after it, which the block grows into again, both times in place. */
+static bool
+realloc_shrink_last(void)
+{
+    const size_t ARENA = 1024 * 1024;
+    size_t size = ARENA - ARENA_OVERHEAD, size_small = size / 4;
+    unsigned char *c, *c2;
+    unsigned int checksum;
+    bool ok = true;
+
+    mem_set_arena_size(ARENA, ARENA);
+    c = buf_alloc(size);
+    checksum = buf_checksum(c, size_small);
+    if (!block_get_flag_last(payload_to_block(c))) {
+        printf("Block of %zu bytes is not the last block of its arena\n", size);
+        ok = false;
+    }
+    c2 = mem_realloc(c, size_small);
+    if (c2 != c || block_get_flag_last(payload_to_block(c))) {
+        printf("Last block [%p] of an arena was not shrunk in place to %zu bytes\n", c, size_small);
+        ok = false;
+    } else if (block_get_flag_busy(block_next(payload_to_block(c)))) {
+        printf("Rest of the last block [%p] of an arena is not free\n", c);
+        ok = false;
+    }
+    if (buf_checksum(c2, size_small) != checksum) {
+        printf("Checksum failed at [%p] after shrinking the last block of an arena\n", c2);
+        ok = false;
+    }
+    c = mem_realloc(c2, size);
+    if (c != c2) {
+        printf("Block [%p] did not grow back into the rest of its arena\n", c2);
+        ok = false;
+    }
+    if (buf_checksum(c, size_small) != checksum) {
+        printf("Checksum failed at [%p] after growing the last block of an arena back\n", c);
+        ok = false;
+    }
+    mem_free(c);
+    mem_set_arena_size(ALLOCATOR_ARENA_PAGES * kernel_page_size(), ALLOCATOR_ARENA_SIZE_MAX);
+    return ok;
+}
+
+/* Function that grows and shrinks a block allocated directly from the kernel, it must keep its contents
+ * and stay mapped as long as it does not fit into an arena. */
+static bool
+realloc_mapped(void)
+{
+    const size_t ARENA = 1024 * 1024;
+    static const size_t sizes[] = { 6 * 1024 * 1024, 3 * 1024 * 1024, 100000 };
+    size_t size = 2 * 1024 * 1024, i;
+    unsigned char *c;
+    unsigned int checksum;
+    bool ok = true;
+
+    mem_set_arena_size(ARENA, ARENA);
+    c = buf_alloc(size);
+    if (!block_get_flag_mapped(payload_to_block(c))) {
+        printf("Block of %zu bytes was not allocated directly from the kernel\n", size);
+        ok = false;
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        checksum = buf_checksum(c, size < sizes[i] ? size : sizes[i]);
+        c = mem_realloc(c, sizes[i]);
+        if (buf_checksum(c, size < sizes[i] ? size : sizes[i]) != checksum) {
+            printf("Checksum failed at [%p] after reallocating a mapped block of %zu bytes to %zu\n",
+                   c, size, sizes[i]);
+            ok = false;
+        }
+        if (sizes[i] > ARENA && !block_get_flag_mapped(payload_to_block(c))) {
+            printf("Block of %zu bytes is not mapped after reallocation\n", sizes[i]);
+            ok = false;
+        }
+        size = sizes[i];
+        buf_fill(c, size);
+    }
+    mem_free(c);
+    mem_set_arena_size(ALLOCATOR_ARENA_PAGES * kernel_page_size(), ALLOCATOR_ARENA_SIZE_MAX);
+    return ok;
+}
+
+/* Function tester_realloc() checks the contents of blocks that mem_realloc() resizes in place
+ * and of their neighbours: a block that grows into its free left neighbour only and into free neighbours on both sides,
+ * the last block of an arena that shrinks and a block allocated directly from the kernel that grows and shrinks. */
+bool
+tester_realloc(void)
+{
+    bool ok = true;
+
+    ok &= realloc_grow_left(false);
+    ok &= realloc_grow_left(true);
+    ok &= realloc_shrink_last();
+    ok &= realloc_mapped();
+    return ok;
+}
+
+/* Function tester_aligned() allocates blocks of several sizes with every alignment from 32 bytes to two pages
+ * and fills them. Every payload must be aligned, and no block may overwrite another one,
+ * which would show in the checksums of the blocks allocated before it and around it. */
+bool
+tester_aligned(void)
+{
+    static const size_t sizes[] = { 1, 100, 1000, 5000, 70000 };
+    const size_t N_SIZES = sizeof(sizes) / sizeof(sizes[0]);
+    size_t alignment, alignment_max = 2 * kernel_page_size(), n = 0, idx, i;
+    struct T t[64];
+    bool ok = true;
+
+    for (alignment = 32; alignment <= alignment_max; alignment *= 2)
+        for (i = 0; i < N_SIZES && n < sizeof(t) / sizeof(t[0]); ++i) {
+            t[n].ptr = mem_aligned_alloc(alignment, sizes[i]);
+            if (t[n].ptr == NULL || (uintptr_t)t[n].ptr % alignment != 0) {
+                printf("Block [%p] of %zu bytes is not aligned to %zu bytes\n", t[n].ptr, sizes[i], alignment);
+                mem_free(t[n].ptr);
+                ok = false;
+                continue;
+            }
+            t[n].size = sizes[i];
+            buf_fill(t[n].ptr, t[n].size);
+            t[n].checksum = buf_checksum(t[n].ptr, t[n].size);
+            ++n;
+        }
+    for (idx = 0; idx < n; ++idx)
+        if (buf_checksum(t[idx].ptr, t[idx].size) != t[idx].checksum) {
+            printf("Checksum failed at [%p] after aligned allocations\n", t[idx].ptr);
+            ok = false;
+        }
+    for (idx = 0; idx < n; ++idx)
+        mem_free(t[idx].ptr);
+    return ok;
+}
+
+/* Function tester_dump() parses a heap dump from mem_dump(). The blocks of every arena must follow each other
+ * from the first block up to the last one and, with the header of the arena, add up to whole pages.
+ * With the arena cache emptied by mem_trim(), the arenas and the blocks allocated directly from the kernel
+ * must add up to the memory mapped according to mem_stats(). */
+bool
+tester_dump(void)
+{
+    struct mem_stats s;
+    uint64_t *words, page_size, arena_size, size, arena_total = 0, arenas = 0, large_bytes = 0;
+    uintptr_t block;
+    size_t total, n, idx;
+    bool ok = true, end = false;
+
+    mem_trim();
+    mem_stats(&s);
+    total = mem_dump(NULL, 0);
+    words = malloc(total);
+    n = mem_dump(words, total) / sizeof(words[0]);
+    if (n * sizeof(words[0]) != total || n < 5 || words[0] != MEM_DUMP_MAGIC) {
+        printf("Heap dump of %zu bytes does not start with MEM_DUMP_MAGIC\n", total);
+        free(words);
+        return false;
+    }
+    page_size = words[1];
+    for (idx = 2; ok && !end && idx < n; ) {
+        if ((words[idx] & ~(uint64_t)MEM_DUMP_HUGE & 0xff) == MEM_DUMP_ARENA && idx + 1 < n) {
+            block = (uintptr_t)words[idx + 1];
+            arena_size = ARENA_OVERHEAD - BLOCK_STRUCT_SIZE;
+            if ((block - ARENA_BLOCK_OFFSET) % page_size != 0) {
+                printf("First block [%p] of an arena is not at the start of a page\n", (void *)block);
+                ok = false;
+            }
+            for (idx += 2; ok && idx < n; ++idx) {
+                size = words[idx] & ~(uint64_t)(MEM_DUMP_BUSY | MEM_DUMP_LAST | MEM_DUMP_CLEAN | MEM_DUMP_BINNED);
+                if (block_get_size_curr((Block *)block) + BLOCK_STRUCT_SIZE != size) {
+                    printf("Block [%p] of %llu bytes in the heap dump has %zu bytes\n", (void *)block,
+                           (unsigned long long)size, block_get_size_curr((Block *)block) + BLOCK_STRUCT_SIZE);
+                    ok = false;
+                }
+                block += size;
+                arena_size += size;
+                if (words[idx] & MEM_DUMP_LAST)
+                    break;
+            }
+            if (arena_size % page_size != 0) {
+                printf("Blocks of an arena add up to %llu bytes, not whole pages\n", (unsigned long long)arena_size);
+                ok = false;
+            }
+            arena_total += arena_size;
+            ++arenas;
+            ++idx;
+        } else if (words[idx] == MEM_DUMP_END && idx + 2 < n) {
+            large_bytes = words[idx + 2];
+            end = true;
+        } else {
+            printf("Unexpected word %#llx at %zu of the heap dump\n", (unsigned long long)words[idx], idx);
+            ok = false;
+        }
+    }
+    if (ok && (!end || arenas != s.arenas || arena_total + large_bytes != s.mapped)) {
+        printf("Heap dump has %llu bytes in %llu arenas and %llu bytes of large blocks, "
+               "mem_stats() %zu bytes in %zu arenas\n", (unsigned long long)arena_total,
+               (unsigned long long)arenas, (unsigned long long)large_bytes, s.mapped, s.arenas);
+        ok = false;
+    }
+    free(words);
+    return ok;
+}
+
+/* Function tester_trace() traces a few calls into a temporary file. The file must start with MEM_TRACE_MAGIC
+ * and end with a MEM_TRACE_LOST record, and every call must have a record or be counted as lost. */
+bool
+tester_trace(void)
+{
+    const size_t N = 100;
+    struct mem_trace_record rec, last = { .op = MEM_TRACE_ALLOC };
+    void *ptrs[100];
+    uint64_t magic = 0;
+    size_t idx, count = 0;
+    bool ok = true;
+    FILE *f;
+
+    f = tmpfile();
+    if (f == NULL || !mem_trace_start(fileno(f))) {
+        printf("Tracing could not be started\n");
+        if (f != NULL)
+            fclose(f);
+        return false;
+    }
+    for (idx = 0; idx < N; ++idx)
+        ptrs[idx] = mem_alloc(idx + 1);
+    for (idx = 0; idx < N; ++idx)
+        mem_free(ptrs[idx]);
+    mem_trace_stop();
+
+    rewind(f);
+    if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != MEM_TRACE_MAGIC) {
+        printf("Trace does not start with MEM_TRACE_MAGIC\n");
+        ok = false;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        last = rec;
+        ++count;
+    }
+    if (last.op != MEM_TRACE_LOST) {
+        printf("Trace does not end with a MEM_TRACE_LOST record\n");
+        ok = false;
+    } else if (count - 1 + last.size != 2 * N) {
+        printf("Trace has %zu records and %llu lost ones of %zu calls\n", count - 1, (unsigned long long)last.size, 2 * N);
+        ok = false;
+    }
+    fclose(f);
+    return ok;
 }
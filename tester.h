@@ -1,3 +1,11 @@
 #include <stdbool.h>
 
-void tester(bool);
+bool tester(bool);
+void tester_overhead(void);
+bool tester_prof_slab(void);
+bool tester_trim(void);
+bool tester_calloc(void);
+bool tester_realloc(void);
+bool tester_aligned(void);
+bool tester_dump(void);
+bool tester_trace(void);
@@ -0,0 +1,243 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "config.h"
+#include "kernel.h"
+#include "lock.h"
+#include "trace.h"
+
+_Static_assert((ALLOCATOR_TRACE_RING & (ALLOCATOR_TRACE_RING - 1)) == 0, "ALLOCATOR_TRACE_RING must be a power of two");
+
+/* Ring buffer of a thread. The thread is the only one that writes records and moves head,
+ * the flusher is the only one that reads them and moves tail, so neither takes a lock.
+ * Both are free running counters, a record is at their value modulo ALLOCATOR_TRACE_RING.
+ * Rings are mapped from the kernel, so tracing never calls the allocator it traces.
+ * The ring of an exited thread is reused by a new one, rings are never unmapped. */
+struct trace_ring {
+    struct trace_ring *next;	// All rings ever mapped, newest first
+    atomic_bool used;		// The ring belongs to a running thread
+    atomic_size_t head;
+    atomic_size_t tail;
+    uint32_t thread;
+    struct mem_trace_record records[ALLOCATOR_TRACE_RING];
+};
+
+atomic_bool trace_enabled;
+static int trace_fd = -1;			// File descriptor of the trace, -1 while tracing is stopped
+static lock_type trace_lock = LOCK_INITIALIZER;	// Serializes mem_trace_start() and mem_trace_stop()
+static _Atomic(struct trace_ring *) trace_rings;
+static atomic_uint trace_threads;		// Number of threads that have got a ring
+static atomic_size_t trace_lost;		// Records lost since mem_trace_start()
+static _Thread_local struct trace_ring *trace_ring;	// Ring of the calling thread
+static _Thread_local bool trace_busy;		// Calls made by the thread while it records one are not traced
+
+// Function that returns the current time in nanoseconds
+static uint64_t trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Function trace_drain() writes the records of the ring out to the trace file.
+ * Records that could not be written are counted as lost. */
+static void trace_drain(struct trace_ring *ring) {
+    size_t head, tail, count;
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head) {
+	// Records up to the end of the array at most, the rest is at its start
+        count = ALLOCATOR_TRACE_RING - tail % ALLOCATOR_TRACE_RING;
+        if (count > head - tail) {
+            count = head - tail;
+        }
+        if (!kernel_write(trace_fd, &ring->records[tail % ALLOCATOR_TRACE_RING], count * sizeof(ring->records[0]))) {
+            atomic_fetch_add_explicit(&trace_lost, count, memory_order_relaxed);
+        }
+        tail += count;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+// Function that writes the records of all rings out to the trace file
+static void trace_flush(void) {
+    struct trace_ring *ring;
+
+    for (ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        trace_drain(ring);
+    }
+}
+
+#if ALLOCATOR_THREADS
+#include <pthread.h>
+
+static pthread_t trace_thread;
+static atomic_bool trace_stopping;	// mem_trace_stop() waits for the flusher to exit
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// Function that is called on thread exit and gives the ring of the thread to the next new thread
+static void trace_destructor(void *arg) {
+    struct trace_ring *ring = arg;
+
+    trace_ring = NULL;
+    atomic_store_explicit(&ring->used, false, memory_order_release);
+}
+
+static void trace_key_create(void) {
+    pthread_key_create(&trace_key, trace_destructor);
+}
+
+// Function that runs in the background and writes the records out every ALLOCATOR_TRACE_FLUSH_MS milliseconds
+static void *trace_flusher(void *arg) {
+    struct timespec delay = {
+        ALLOCATOR_TRACE_FLUSH_MS / 1000, (long)(ALLOCATOR_TRACE_FLUSH_MS % 1000) * 1000000
+    };
+
+    (void)arg;
+    while (!atomic_load_explicit(&trace_stopping, memory_order_acquire)) {
+        trace_flush();
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+#endif
+
+/* Function trace_claim() gives the calling thread a ring: one left by an exited thread, or a new one.
+ * It returns NULL if there is no memory for a new ring. */
+static struct trace_ring *trace_claim(void) {
+    struct trace_ring *ring;
+    bool used;
+
+    for (ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        used = false;
+        if (atomic_compare_exchange_strong_explicit(&ring->used, &used, true,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = kernel_alloc(sizeof(*ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->used, true);
+        ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&trace_rings, &ring->next, ring,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    ring->thread = atomic_fetch_add_explicit(&trace_threads, 1, memory_order_relaxed) + 1;
+#if ALLOCATOR_THREADS
+    // pthread_setspecific() may allocate, which is not traced while trace_busy is set
+    pthread_once(&trace_key_once, trace_key_create);
+    pthread_setspecific(trace_key, ring);
+#endif
+    trace_ring = ring;
+    return ring;
+}
+
+/* Function trace_record() appends a record of a call to the ring of the calling thread.
+ * If the ring is full, the record is lost: the thread never waits for the flusher.
+ * Without threads there is no flusher, the thread writes the full ring out itself. */
+void trace_record(enum mem_trace_op op, const void *ptr, uint64_t result, size_t size) {
+    struct trace_ring *ring;
+    struct mem_trace_record *record;
+    size_t head;
+
+    if (trace_busy) {
+        return;
+    }
+    trace_busy = true;
+    ring = trace_ring;
+    if (ring == NULL && (ring = trace_claim()) == NULL) {
+        atomic_fetch_add_explicit(&trace_lost, 1, memory_order_relaxed);
+        trace_busy = false;
+        return;
+    }
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ALLOCATOR_TRACE_RING) {
+#if ALLOCATOR_THREADS
+        atomic_fetch_add_explicit(&trace_lost, 1, memory_order_relaxed);
+        trace_busy = false;
+        return;
+#else
+        trace_drain(ring);
+#endif
+    }
+    record = &ring->records[head % ALLOCATOR_TRACE_RING];
+    record->time = trace_now();
+    record->ptr = (uintptr_t)ptr;
+    record->result = result;
+    record->size = size;
+    record->thread = ring->thread;
+    record->op = op;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    trace_busy = false;
+}
+
+/* Function mem_trace_start() starts tracing into the file descriptor.
+ * It returns false if tracing is on already, the magic number could not be written or the flusher could not start. */
+bool mem_trace_start(int fd) {
+    uint64_t magic = MEM_TRACE_MAGIC;
+    struct trace_ring *ring;
+
+    lock_acquire(&trace_lock);
+    if (trace_fd >= 0 || fd < 0 || !kernel_write(fd, &magic, sizeof(magic))) {
+        lock_release(&trace_lock);
+        return false;
+    }
+    // Records that came in after the last trace was stopped do not belong to this one
+    for (ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->head, memory_order_acquire),
+                              memory_order_release);
+    }
+    trace_fd = fd;
+    atomic_store_explicit(&trace_lost, 0, memory_order_relaxed);
+#if ALLOCATOR_THREADS
+    atomic_store_explicit(&trace_stopping, false, memory_order_relaxed);
+    if (pthread_create(&trace_thread, NULL, trace_flusher, NULL) != 0) {
+        trace_fd = -1;
+        lock_release(&trace_lock);
+        return false;
+    }
+#endif
+    atomic_store_explicit(&trace_enabled, true, memory_order_relaxed);
+    lock_release(&trace_lock);
+    return true;
+}
+
+/* Function mem_trace_stop() stops tracing, waits for the flusher and writes out the records left in the rings.
+ * A call that is being recorded right now by another thread may miss the trace. */
+void mem_trace_stop(void) {
+    struct mem_trace_record lost = { .op = MEM_TRACE_LOST };
+
+    lock_acquire(&trace_lock);
+    if (trace_fd < 0) {
+        lock_release(&trace_lock);
+        return;
+    }
+    atomic_store_explicit(&trace_enabled, false, memory_order_relaxed);
+#if ALLOCATOR_THREADS
+    atomic_store_explicit(&trace_stopping, true, memory_order_release);
+    pthread_join(trace_thread, NULL);
+#endif
+    trace_flush();
+    lost.time = trace_now();
+    lost.size = atomic_load_explicit(&trace_lost, memory_order_relaxed);
+    kernel_write(trace_fd, &lost, sizeof(lost));
+    trace_fd = -1;
+    lock_release(&trace_lock);
+}
+
+// The child has no flusher and must not write into the trace of its parent
+void trace_fork_child(void) {
+    lock_init(&trace_lock);
+    atomic_store_explicit(&trace_enabled, false, memory_order_relaxed);
+    trace_fd = -1;
+}
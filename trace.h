@@ -0,0 +1,17 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Calls are traced, set by mem_trace_start()
+extern atomic_bool trace_enabled;
+
+// Function that checks if calls are traced, this is all an untraced call pays
+static inline bool trace_on(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+// Function that appends a record of a call to the ring buffer of the calling thread
+void trace_record(enum mem_trace_op, const void *, uint64_t, size_t);
+
+// Function that stops tracing in a child process, the background thread has not been forked
+void trace_fork_child(void);